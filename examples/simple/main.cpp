@@ -17,18 +17,6 @@ using namespace reckoning;
 using namespace reckoning::log;
 using namespace std::chrono_literals;
 
-std::shared_ptr<event::Loop> mainLoopPtr;
-
-static void sigintHandler(int)
-{
-    // might not be safe to do this from a signal handler, but eh
-    std::shared_ptr<event::Loop> loop;
-    loop = atomic_load(&mainLoopPtr);
-    if (loop) {
-        loop->exit();
-    }
-}
-
 #define HAVE_CREF
 
 class Test
@@ -68,8 +56,6 @@ event::Signal<int, Test&&> sig;
 
 int main(int argc, char** argv)
 {
-    signal(SIGINT, sigintHandler);
-
     Log::initialize(Log::Debug);
 
     {
@@ -110,7 +96,10 @@ int main(int argc, char** argv)
 
 
     std::shared_ptr<event::Loop> loop = event::Loop::create();
-    atomic_store(&mainLoopPtr, loop);
+    // before any threads are started so that they all have these blocked
+    loop->addSignal(SIGINT, [](int) {
+        event::Loop::loop()->exit();
+    });
 
     /*
     auto conn = sig.connect([](int i, Test&& t) {
@@ -24,9 +24,12 @@ public:
     static Pool<NumberOfBuffers, SizeOfBuffer>& pool();
 
 private:
+    // on the heap rather than inline, a thread's static TLS is set up by whoever
+    // creates the thread. allocated by the pool's own thread the memory follows that
+    // thread's memory policy, see util::thread::setMemoryNode()
+    std::unique_ptr<uint8_t[]> mBufferData;
     std::vector<std::shared_ptr<Buffer> > mBuffers;
     thread_local static Pool<NumberOfBuffers, SizeOfBuffer> tPool;
-    uint8_t mBufferData[NumberOfBuffers * SizeOfBuffer];
 };
 
 template<size_t NumberOfBuffers, size_t SizeOfBuffer>
@@ -34,9 +37,10 @@ thread_local Pool<NumberOfBuffers, SizeOfBuffer> Pool<NumberOfBuffers, SizeOfBuf
 
 template<size_t NumberOfBuffers, size_t SizeOfBuffer>
 inline Pool<NumberOfBuffers, SizeOfBuffer>::Pool()
+    : mBufferData(new uint8_t[NumberOfBuffers * SizeOfBuffer])
 {
     mBuffers.reserve(NumberOfBuffers);
-    uint8_t* mem = mBufferData;
+    uint8_t* mem = mBufferData.get();
     for (size_t i = 0; i < NumberOfBuffers; ++i) {
         mBuffers.push_back(Buffer::create(Buffer::NotOwned, mem, SizeOfBuffer));
         mem += SizeOfBuffer;
@@ -0,0 +1,209 @@
+#ifndef AWAIT_H
+#define AWAIT_H
+
+#include <coro/Task.h>
+#include <event/Loop.h>
+#include <event/Signal.h>
+#include <then/Then.h>
+#include <chrono>
+#include <coroutine>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+namespace reckoning {
+namespace coro {
+
+namespace detail {
+// Awaiters live in the coroutine frame, which can be destroyed while suspended, eg
+// when the owning Task is dropped. callbacks reach the awaiter through one of these
+// and the awaiter's destructor clears it, so that a late callback finds nobody to
+// resume instead of a freed frame
+template<typename Awaiter>
+using AwaiterRef = std::shared_ptr<Awaiter*>;
+
+// co_await on a then::Then gives a then::MaybeFail with either the value or the failure
+template<typename T>
+class ThenAwaiter
+{
+public:
+    ThenAwaiter(then::Then<T>& then) : mThen(then) { }
+    ~ThenAwaiter();
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    then::MaybeFail<T> await_resume() { return std::move(*mResult); }
+
+private:
+    then::Then<T>& mThen;
+    std::optional<then::MaybeFail<T> > mResult;
+    AwaiterRef<ThenAwaiter> mSelf;
+};
+
+template<typename T>
+inline ThenAwaiter<T>::~ThenAwaiter()
+{
+    if (mSelf)
+        *mSelf = nullptr;
+}
+
+template<typename T>
+inline void ThenAwaiter<T>::await_suspend(std::coroutine_handle<> handle)
+{
+    mSelf = std::make_shared<ThenAwaiter*>(this);
+    if constexpr (std::is_void<T>::value) {
+        mThen.then([self = mSelf, handle]() {
+            if (!*self)
+                return;
+            (*self)->mResult.emplace();
+            handle.resume();
+        });
+    } else {
+        mThen.then([self = mSelf, handle](T&& value) {
+            if (!*self)
+                return;
+            (*self)->mResult.emplace(std::move(value));
+            handle.resume();
+        });
+    }
+    mThen.fail([self = mSelf, handle](std::string&& failure) {
+        if (!*self)
+            return;
+        (*self)->mResult.emplace(then::Fail(std::move(failure)));
+        handle.resume();
+    });
+}
+
+template<typename ...Args>
+struct SignalValue
+{
+    using type = std::tuple<typename std::decay<Args>::type...>;
+};
+
+template<>
+struct SignalValue<>
+{
+    using type = void;
+};
+
+template<typename Arg>
+struct SignalValue<Arg>
+{
+    using type = typename std::decay<Arg>::type;
+};
+
+template<typename ...Args>
+class SignalAwaiter
+{
+public:
+    using Value = typename SignalValue<Args...>::type;
+
+    SignalAwaiter(event::Signal<Args...>& signal) : mSignal(signal) { }
+    ~SignalAwaiter();
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    Value await_resume();
+
+private:
+    using Storage = typename std::conditional<std::is_void<Value>::value, bool, Value>::type;
+
+    event::Signal<Args...>& mSignal;
+    typename event::Signal<Args...>::Connection mConnection;
+    std::optional<Storage> mValue;
+    AwaiterRef<SignalAwaiter> mSelf;
+};
+
+template<typename ...Args>
+inline SignalAwaiter<Args...>::~SignalAwaiter()
+{
+    // an emit from another thread might already be on its way to the loop, disconnecting
+    // alone doesn't stop that one
+    if (mSelf)
+        *mSelf = nullptr;
+    mConnection.disconnect();
+}
+
+template<typename ...Args>
+inline void SignalAwaiter<Args...>::await_suspend(std::coroutine_handle<> handle)
+{
+    mSelf = std::make_shared<SignalAwaiter*>(this);
+    mConnection = mSignal.connect([self = mSelf, handle](auto&& ...args) {
+        SignalAwaiter* awaiter = *self;
+        // only the first emit counts
+        if (!awaiter || awaiter->mValue.has_value())
+            return;
+        awaiter->mConnection.disconnect();
+        if constexpr (std::is_void<Value>::value) {
+            awaiter->mValue.emplace(true);
+        } else {
+            awaiter->mValue.emplace(std::move(args)...);
+        }
+        handle.resume();
+    });
+}
+
+template<typename ...Args>
+inline typename SignalAwaiter<Args...>::Value SignalAwaiter<Args...>::await_resume()
+{
+    if constexpr (!std::is_void<Value>::value)
+        return std::move(*mValue);
+}
+} // namespace detail
+
+// co_await next(signal) resumes with the arguments of the next emit, a single
+// argument is returned as is and several as a std::tuple
+template<typename ...Args>
+inline detail::SignalAwaiter<Args...> next(event::Signal<Args...>& signal)
+{
+    return detail::SignalAwaiter<Args...>(signal);
+}
+
+}} // namespace reckoning::coro
+
+namespace reckoning {
+namespace then {
+
+template<typename T>
+inline coro::detail::ThenAwaiter<T> operator co_await(Then<T>& then)
+{
+    return coro::detail::ThenAwaiter<T>(then);
+}
+
+}} // namespace reckoning::then
+
+namespace reckoning {
+namespace event {
+
+inline auto Loop::sleep(std::chrono::nanoseconds timeout)
+{
+    struct Awaiter
+    {
+        std::shared_ptr<Loop> loop;
+        std::chrono::nanoseconds timeout;
+        // stopped if the frame goes away before it fires
+        std::shared_ptr<Timer> timer;
+
+        ~Awaiter()
+        {
+            if (timer)
+                timer->stop();
+        }
+
+        bool await_ready() { return timeout <= std::chrono::nanoseconds{0}; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            timer = loop->addTimer(timeout, [handle]() {
+                handle.resume();
+            });
+        }
+        void await_resume() { }
+    };
+    return Awaiter { shared_from_this(), timeout, nullptr };
+}
+
+}} // namespace reckoning::event
+
+#endif // AWAIT_H
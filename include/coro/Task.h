@@ -0,0 +1,155 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <util/SizeClassAllocator.h>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace reckoning {
+namespace coro {
+
+template<typename T = void>
+class Task;
+
+namespace detail {
+// Coroutine frames come from the per thread size class allocator. Loops are one per
+// thread and coroutines are resumed on the loop that awaited, so in practice a frame
+// is allocated and freed by the same loop.
+class PromiseBase
+{
+public:
+    static void* operator new(size_t size) { return util::SizeClassAllocator::allocator().allocate(size); }
+    static void operator delete(void* ptr) { util::SizeClassAllocator::allocator().deallocate(ptr); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // resumes whoever awaited us, or frees the frame if nobody will
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            PromiseBase& promise = handle.promise();
+            if (promise.mDetached) {
+                handle.destroy();
+                return std::noop_coroutine();
+            }
+            if (promise.mContinuation)
+                return promise.mContinuation;
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept { }
+    };
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    // no exceptions in reckoning
+    void unhandled_exception() { std::terminate(); }
+
+private:
+    std::coroutine_handle<> mContinuation;
+    bool mDetached { false };
+
+    template<typename T>
+    friend class coro::Task;
+};
+} // namespace detail
+
+// A lazily started coroutine. Awaiting a Task starts it and resumes the awaiter
+// when it co_returns, start() runs it detached and lets it clean up after itself.
+template<typename T>
+class Task
+{
+public:
+    struct promise_type : public detail::PromiseBase
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        template<typename U>
+        void return_value(U&& value) { mValue.emplace(std::forward<U>(value)); }
+
+        std::optional<T> mValue;
+    };
+
+    Task(Task&& other) : mHandle(std::exchange(other.mHandle, nullptr)) { }
+    Task& operator=(Task&& other);
+    ~Task();
+
+    void start();
+
+    auto operator co_await() &&;
+
+private:
+    Task(std::coroutine_handle<promise_type> handle) : mHandle(handle) { }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    std::coroutine_handle<promise_type> mHandle;
+};
+
+template<>
+struct Task<void>::promise_type : public detail::PromiseBase
+{
+    Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+    void return_void() { }
+};
+
+template<typename T>
+inline Task<T>& Task<T>::operator=(Task&& other)
+{
+    if (mHandle)
+        mHandle.destroy();
+    mHandle = std::exchange(other.mHandle, nullptr);
+    return *this;
+}
+
+template<typename T>
+inline Task<T>::~Task()
+{
+    if (mHandle)
+        mHandle.destroy();
+}
+
+template<typename T>
+inline void Task<T>::start()
+{
+    auto handle = std::exchange(mHandle, nullptr);
+    if (!handle)
+        return;
+    handle.promise().mDetached = true;
+    handle.resume();
+}
+
+template<typename T>
+inline auto Task<T>::operator co_await() &&
+{
+    struct Awaiter
+    {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() { return !handle || handle.done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+        {
+            handle.promise().mContinuation = awaiting;
+            return handle;
+        }
+        T await_resume()
+        {
+            if constexpr (!std::is_void<T>::value)
+                return std::move(*handle.promise().mValue);
+        }
+    };
+    return Awaiter { mHandle };
+}
+
+}} // namespace reckoning::coro
+
+#endif // TASK_H
@@ -0,0 +1,149 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <event/Loop.h>
+#include <event/Signal.h>
+#include <util/Creatable.h>
+#include <util/SmallFunction.h>
+#include <util/SpscQueue.h>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace reckoning {
+namespace event {
+
+// One way pipe for values of type T from one loop to another. Values are moved into a
+// fixed size SpscQueue instead of each getting an Event of its own, and the consumer
+// is woken up once per batch: the first send after the consumer has started draining
+// posts a drain, the ones after that only add to the ring until it runs.
+template<typename T>
+class Channel : public std::enable_shared_from_this<Channel<T> >, public util::Creatable<Channel<T> >
+{
+public:
+    using Receiver = util::SmallFunction<void(T&&)>;
+
+    // on the consumer's loop thread, or before anything is sent. values sent while
+    // there's no receiver stay in the ring
+    template<typename F, typename std::enable_if<std::is_invocable_r<void, F, T&&>::value, F>::type* = nullptr>
+    void onReceive(F&& func);
+
+    // on the producer's loop thread only. returns false and leaves value alone if the
+    // consumer has fallen capacity() values behind, onWritable() is emitted once it
+    // has made room again
+    bool send(T&& value);
+    bool send(const T& value);
+
+    Signal<>& onWritable() { return mWritable; }
+
+    size_t capacity() const { return mQueue.capacity(); }
+
+protected:
+    Channel(const std::shared_ptr<Loop>& producer, const std::shared_ptr<Loop>& consumer, size_t capacity = 1024);
+
+private:
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    template<typename U>
+    bool push(U&& value);
+    void schedule();
+    void drain();
+
+private:
+    util::SpscQueue<T> mQueue;
+    std::weak_ptr<Loop> mProducer, mConsumer;
+    Receiver mReceiver;
+    // set while a drain is posted and hasn't started yet
+    std::atomic<bool> mScheduled { false };
+    // set by a send that found the ring full
+    std::atomic<bool> mFull { false };
+    Signal<> mWritable;
+};
+
+template<typename T>
+inline Channel<T>::Channel(const std::shared_ptr<Loop>& producer, const std::shared_ptr<Loop>& consumer, size_t capacity)
+    : mQueue(capacity), mProducer(producer), mConsumer(consumer)
+{
+}
+
+template<typename T>
+template<typename F, typename std::enable_if<std::is_invocable_r<void, F, T&&>::value, F>::type*>
+inline void Channel<T>::onReceive(F&& func)
+{
+    mReceiver = Receiver(std::forward<F>(func));
+    // pick up whatever came in while no one was listening
+    if (!mQueue.empty())
+        schedule();
+}
+
+template<typename T>
+inline bool Channel<T>::send(T&& value)
+{
+    return push(std::move(value));
+}
+
+template<typename T>
+inline bool Channel<T>::send(const T& value)
+{
+    return push(value);
+}
+
+template<typename T>
+template<typename U>
+inline bool Channel<T>::push(U&& value)
+{
+    assert(mProducer.expired() || mProducer.lock()->isLoopThread());
+    if (!mQueue.push(std::forward<U>(value))) {
+        // the consumer might have made room before it could see the flag, look again
+        mFull.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!mQueue.push(std::forward<U>(value)))
+            return false;
+    }
+    schedule();
+    return true;
+}
+
+template<typename T>
+inline void Channel<T>::schedule()
+{
+    // pairs with the fence in drain(), either the consumer sees our value or we see
+    // that it's no longer scheduled
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mScheduled.load(std::memory_order_relaxed) || mScheduled.exchange(true))
+        return;
+    auto consumer = mConsumer.lock();
+    if (!consumer)
+        return;
+    consumer->post([self = this->shared_from_this()]() {
+        self->drain();
+    });
+}
+
+template<typename T>
+inline void Channel<T>::drain()
+{
+    mScheduled.store(false, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!mReceiver)
+        return;
+
+    // at most one ring's worth, then let the loop get to its other work
+    const size_t drained = mQueue.drain([this](T&& value) {
+        mReceiver(std::move(value));
+    }, mQueue.capacity());
+    if (drained) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mFull.load(std::memory_order_relaxed) && mFull.exchange(false))
+            mWritable.emit();
+    }
+    if (!mQueue.empty())
+        schedule();
+}
+
+}} // namespace reckoning::event
+
+#endif // CHANNEL_H
@@ -0,0 +1,148 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <event/Loop.h>
+#include <then/Then.h>
+#include <util/MpscQueue.h>
+#include <util/SmallFunction.h>
+#include <util/WorkStealingDeque.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace reckoning {
+namespace event {
+
+// Worker pool for blocking and CPU heavy work. Each worker has its own lock free
+// deque, tasks posted from a worker go to the bottom of that worker's deque and are
+// picked up from there first, newest first. Tasks posted from any other thread go on
+// a shared lock free queue that idle workers empty into their own deques. Workers
+// that run dry steal the oldest tasks from the others and only then go to sleep,
+// each on its own futex so that a post wakes at most one of them. Workers are named
+// worker followed by their index and can be restricted to a set of cpus.
+class Executor
+{
+public:
+    using Task = util::SmallFunction<void()>;
+
+    Executor(size_t threads = 0, std::vector<unsigned int> cpus = {});
+    ~Executor();
+
+    size_t size() const { return mWorkers.size(); }
+
+    void post(Task&& task);
+
+    // stops the workers, tasks that haven't started yet are dropped
+    void shutdown();
+
+    // the shared executor, started on first use
+    static Executor& executor();
+    // number of threads for the shared executor, only has an effect before its first use
+    static void setDefaultSize(size_t threads);
+    // cpus for the shared executor's workers, only has an effect before its first use
+    static void setDefaultCpus(std::vector<unsigned int> cpus);
+
+private:
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    struct Item
+    {
+        Item(Task&& t) : task(std::move(t)) { }
+
+        Task task;
+        Item* next { nullptr };
+    };
+
+    enum WorkerState : uint32_t { Running, Sleeping, Notified };
+
+    struct Worker
+    {
+        util::WorkStealingDeque<Item> deque;
+        // futex word, Sleeping while parked
+        std::atomic<uint32_t> state { Running };
+    };
+
+    void run(size_t index);
+    Item* find(size_t index);
+    bool hasWork() const;
+    void wakeOne();
+
+private:
+    std::vector<std::unique_ptr<Worker> > mWorkers;
+    std::vector<std::thread> mThreads;
+    std::vector<unsigned int> mCpus;
+
+    // posts from outside the pool
+    util::MpscQueue<Item, &Item::next> mInjected;
+    // parked workers, a post only goes looking for one to wake when this isn't 0
+    std::atomic<size_t> mSleepers;
+    std::atomic<size_t> mNextWake;
+    std::atomic<bool> mStopped;
+
+    static std::atomic<size_t> sDefaultSize;
+    static std::mutex sDefaultCpusMutex;
+    static std::vector<unsigned int> sDefaultCpus;
+};
+
+namespace detail {
+template<typename R, typename = void>
+struct SpawnArg
+{
+    using type = R;
+};
+
+template<typename R>
+struct SpawnArg<R, typename std::enable_if<then::detail::isMaybeFail<R> >::type>
+{
+    using type = typename R::ArgType;
+};
+} // namespace detail
+
+template<typename T>
+inline auto& Loop::spawn(T&& func)
+{
+    using Return = typename std::decay<std::invoke_result_t<T> >::type;
+    using Arg = typename detail::SpawnArg<Return>::type;
+
+    auto chain = std::make_shared<then::Then<Arg> >();
+    std::weak_ptr<Loop> weak = shared_from_this();
+    Executor::executor().post([func = std::forward<T>(func), chain, weak]() mutable {
+        if constexpr (std::is_void<Return>::value) {
+            func();
+            if (auto loop = weak.lock()) {
+                loop->post([chain]() {
+                    chain->resolve();
+                });
+            }
+        } else if constexpr (then::detail::isMaybeFail<Return>) {
+            auto maybeFail = func();
+            if (auto loop = weak.lock()) {
+                loop->post([chain, maybeFail = std::move(maybeFail)]() mutable {
+                    if (maybeFail.isFail()) {
+                        chain->reject(std::move(maybeFail.error()));
+                    } else if constexpr (std::is_void<Arg>::value) {
+                        chain->resolve();
+                    } else {
+                        chain->resolve(std::move(maybeFail.value()));
+                    }
+                });
+            }
+        } else {
+            auto value = func();
+            if (auto loop = weak.lock()) {
+                loop->post([chain, value = std::move(value)]() mutable {
+                    chain->resolve(std::move(value));
+                });
+            }
+        }
+    });
+    return *chain.get();
+}
+
+}} // namespace reckoning::event
+
+#endif // EXECUTOR_H
@@ -2,8 +2,13 @@
 #define EVENTLOOP_H
 
 #include <config.h>
+#include <util/Arena.h>
 #include <util/Creatable.h>
 #include <util/Invocable.h>
+#include <util/MpscQueue.h>
+#include <util/SizeClassAllocator.h>
+#include <util/SmallFunction.h>
+#include <event/TimerWheel.h>
 #include <cassert>
 #include <type_traits>
 #include <atomic>
@@ -13,6 +18,12 @@
 #include <chrono>
 #include <mutex>
 #include <functional>
+#include <memory_resource>
+#include <tuple>
+#include <typeinfo>
+#include <utility>
+#include <pthread.h>
+#include <signal.h>
 
 #if defined(HAVE_KQUEUE)
 #  include <sys/types.h>
@@ -21,6 +32,9 @@
 #elif defined(HAVE_EPOLL)
 #  include <sys/epoll.h>
 #endif
+#if defined(HAVE_IO_URING)
+#  include <sys/uio.h>
+#endif
 
 namespace reckoning {
 namespace event {
@@ -41,16 +55,31 @@ public:
         Event() { }
         virtual ~Event() { }
 
+        // what's being run, for stall reports
+        virtual const std::type_info& type() const { return typeid(*this); }
+
     protected:
         virtual void execute() = 0;
 
+    private:
+        Event* mNextEvent { nullptr };
+
         friend class Loop;
     };
 
+    // Urgent events are run before any Bulk ones, even those posted earlier. Bulk events
+    // are run at most setBulkSlice() per iteration so that fds and timers get a turn
+    // when the loop is flooded, urgent ones are never held back
+    enum Priority { Urgent, Bulk };
+
     template<typename T, typename ...Args>
     typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
     send(T&& func, Args&& ...args);
 
+    template<typename T, typename ...Args>
+    typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
+    send(Priority priority, T&& func, Args&& ...args);
+
     template<typename T, typename std::enable_if<std::is_base_of<Event, T>::value, T>::type* = nullptr>
     void send(T&& event);
 
@@ -58,55 +87,140 @@ public:
     typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
     post(T&& func, Args&& ...args);
 
+    template<typename T, typename ...Args>
+    typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
+    post(Priority priority, T&& func, Args&& ...args);
+
     template<typename T, typename std::enable_if<std::is_base_of<Event, T>::value, T>::type* = nullptr>
     void post(T&& event);
 
-    void send(std::unique_ptr<Event>&& event);
-    void post(std::unique_ptr<Event>&& event);
+    void send(std::unique_ptr<Event>&& event, Priority priority = Bulk);
+    void post(std::unique_ptr<Event>&& event, Priority priority = Bulk);
+
+    // Like send(), but from another loop's thread the event is held until that loop is
+    // done with the events and hooks of its current iteration, or with its fds and
+    // timers, so nothing is left behind while it waits. everything it batched up for us
+    // by then is posted as one event, so at most one wakeup per batch. batched events
+    // keep their order among themselves, but since they're held anything sent the
+    // normal way later in the same round gets there first. outside of an iteration,
+    // before execute() or between runOnce() calls, and from threads without a loop of
+    // their own the event is posted right away
+    template<typename T, typename ...Args>
+    typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
+    sendBatched(T&& func, Args&& ...args);
+    void sendBatched(std::unique_ptr<Event>&& event);
+
+    // the most bulk events run per loop iteration, 1024 by default. loop thread only
+    void setBulkSlice(size_t slice);
+
+    // runs func on the shared Executor and resolves the returned then::Then
+    // on this loop, defined in event/Executor.h
+    template<typename T>
+    auto& spawn(T&& func);
 
-    // Timers
+    // co_await loop->sleep(timeout) in a coroutine, defined in coro/Await.h
+    auto sleep(std::chrono::nanoseconds timeout);
+
+    // Timers. timeouts have nanosecond precision and deadlines are absolute steady_clock
+    // time points as given by now(), intervals are rescheduled from their previous
+    // deadline so they don't drift
     enum TimerFlag { Timeout, Interval };
+    using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
 
     class Timer
     {
     public:
-        Timer(std::chrono::milliseconds timeout, TimerFlag flag = Timeout) : mTimeout(timeout), mFlag(flag) { }
+        Timer(std::chrono::nanoseconds timeout, TimerFlag flag = Timeout) : mTimeout(timeout), mFlag(flag) { }
         virtual ~Timer() { }
 
-        std::chrono::milliseconds timeout() const { return mTimeout; }
-        std::chrono::time_point<std::chrono::steady_clock> next() const { return mNext; }
+        std::chrono::nanoseconds timeout() const { return mTimeout; }
+        TimePoint next() const { return mNext; }
 
         TimerFlag flag() const { return mFlag; }
         std::shared_ptr<Loop> loop() const { return mLoop.lock(); }
 
-        void updateTimeout(std::chrono::milliseconds timeout) { assert(!isActive()); mTimeout = timeout; }
+        void updateTimeout(std::chrono::nanoseconds timeout) { assert(!isActive()); mTimeout = timeout; }
+
+        // how late the timer is allowed to fire. deadlines are rounded up to a multiple
+        // of the slack so that timers close to each other expire in the same wakeup.
+        // negative uses the loop's setTimerSlack(), 0 fires exactly on time. takes
+        // effect the next time the timer is scheduled
+        std::chrono::nanoseconds slack() const { return mSlack; }
+        void setSlack(std::chrono::nanoseconds slack) { mSlack = slack; }
 
         void stop();
         bool isActive() const;
 
+        // what's being run, for stall reports
+        virtual const std::type_info& type() const { return typeid(*this); }
+
     protected:
         virtual void execute() = 0;
 
     private:
-        std::chrono::milliseconds mTimeout;
-        std::chrono::time_point<std::chrono::steady_clock> mNext;
+        std::chrono::nanoseconds mTimeout;
+        std::chrono::nanoseconds mSlack { -1 };
+        // mDeadline is what was asked for, mNext is mDeadline with the slack applied
+        TimePoint mDeadline, mNext;
         TimerFlag mFlag;
         std::weak_ptr<Loop> mLoop;
 
+        // owned by the timer wheel while the timer is active
+        Timer* mWheelPrev { nullptr };
+        Timer* mWheelNext { nullptr };
+        int mWheelSlot { -1 };
+        std::shared_ptr<Timer> mWheelRef;
+
         friend class Loop;
+        friend class detail::TimerWheel<Timer>;
     };
 
     template<typename T, typename ...Args>
     typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, std::shared_ptr<Timer> >::type
-    addTimer(std::chrono::milliseconds timeout, T&& func, Args&& ...args);
+    addTimer(std::chrono::nanoseconds timeout, T&& func, Args&& ...args);
 
     template<typename T, typename ...Args>
     typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, std::shared_ptr<Timer> >::type
-    addTimer(std::chrono::milliseconds timeout, TimerFlag flag, T&& func, Args&& ...args);
+    addTimer(std::chrono::nanoseconds timeout, TimerFlag flag, T&& func, Args&& ...args);
 
     void addTimer(std::shared_ptr<Timer>&& timer);
     void addTimer(const std::shared_ptr<Timer>& timer);
 
+    // fires once at deadline
+    template<typename T, typename ...Args>
+    typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, std::shared_ptr<Timer> >::type
+    addTimerAt(TimePoint deadline, T&& func, Args&& ...args);
+
+    // first fires at deadline, an interval timer then keeps going every timeout()
+    void addTimerAt(std::shared_ptr<Timer>&& timer, TimePoint deadline);
+    void addTimerAt(const std::shared_ptr<Timer>& timer, TimePoint deadline);
+
+    // granularity of the timer wheel, 1ms by default. deadlines are honored exactly
+    // regardless, a finer resolution gives sub millisecond timers their own slots
+    // at the cost of cascading more often. only allowed while no timers are active
+    void setTimerResolution(std::chrono::nanoseconds resolution);
+
+    // default slack for timers that don't set their own, 0 by default. heartbeats
+    // and idle timeouts rarely need to be exact and fewer wakeups save CPU
+    void setTimerSlack(std::chrono::nanoseconds slack);
+
+    // Clock. timers and execute() timeouts go by now(). a VirtualClock loop, made with
+    // Loop::create(Loop::VirtualClock), starts out at the current time and then only
+    // moves when advanced, so hours of timers can be run through in no time and timer
+    // heavy code can be tested without sleeping. busy polling and stall detection
+    // stay on real time
+    enum ClockMode { SteadyClock, VirtualClock };
+    ClockMode clockMode() const { return mClockMode; }
+    TimePoint now() const;
+
+    // VirtualClock only, from any thread. the clock never goes backwards
+    void advance(std::chrono::nanoseconds by);
+    void advanceTo(TimePoint time);
+    // VirtualClock only. when the loop has nothing to do but wait for a timer it skips
+    // straight to it instead of waiting for advance(). fds are still looked at first
+    // but only ones that are already ready get a say, they don't stop the clock
+    void setAutoAdvance(bool autoAdvance);
+
     // File descriptors
     class FD
     {
@@ -127,7 +241,12 @@ public:
         friend class Loop;
     };
 
-    enum FdFlag { FdError = 0x1, FdRead = 0x2, FdWrite = 0x4 };
+    // FdEdgeWrite, only for addFd, keeps the fd registered for write readiness for as long
+    // as it's added. updateFd() toggling FdWrite then only decides whether write events
+    // are delivered and never touches the backend. write events only come when the fd
+    // becomes writable, so only ask for FdWrite after a write hit EAGAIN or while connecting.
+    // io_uring, where backend updates are cheap, arms write readiness only while asked for
+    enum FdFlag { FdError = 0x1, FdRead = 0x2, FdWrite = 0x4, FdEdgeWrite = 0x8 };
     template<typename T, typename std::enable_if<std::is_invocable_r<void, T, int, uint8_t>::value, T>::type* = nullptr>
     FD addFd(int fd, uint8_t flags, T&& callback);
     template<typename T, typename std::enable_if<std::is_invocable_r<void, T, int, uint8_t>::value, T>::type* = nullptr>
@@ -135,15 +254,143 @@ public:
     void updateFd(int fd, uint8_t flags);
     void removeFd(int fd);
 
+    // calls the fd's callback again with flags on the next iteration, after timers and
+    // the other fds have had their turn. for callbacks that stop short of EAGAIN so that
+    // one busy fd can't starve the loop. every backend reports reads edge triggered
+    // (kqueue with EV_CLEAR) so an fd with data left isn't reported again by itself and
+    // only runs once more through here. loop thread only
+    void retryFd(int fd, uint8_t flags);
+
+#if defined(HAVE_IO_URING)
+    // Completion based I/O, io_uring only, for fds added with addFd(). instead of being
+    // told that the fd is ready and then accepting, reading or writing until EAGAIN the
+    // operation itself goes to the kernel with the next poll and the callback gets its
+    // result, so a busy socket costs no syscalls of its own. an fd that does all its I/O
+    // this way updateFd()s itself down to no flags, io_uring doesn't poll those at all.
+    // removing the fd cancels whatever it still has going and those callbacks aren't
+    // called anymore. these return false if the ring can't do it, and a kernel without
+    // multishot accept and recv (before 6.0) hands -EINVAL to the first callback, both
+    // mean use readiness instead. loop thread only
+
+    // keeps accepting, callback gets every new socket, nonblocking and close on exec.
+    // a negative errno ends it
+    using AcceptCallback = util::SmallFunction<void(int)>;
+    bool acceptMultishot(int fd, AcceptCallback&& callback);
+    // keeps receiving into buffers the loop hands the kernel, callback(bytes, data) gets
+    // every chunk and the buffer goes back as soon as the callback returns. 0 for end of
+    // file, a negative errno or -ECANCELED after stopRecv() ends it. running out of
+    // buffers doesn't, the loop takes it up again
+    using RecvCallback = util::SmallFunction<void(int, const uint8_t*)>;
+    bool recvMultishot(int fd, RecvCallback&& callback);
+    // chunks the kernel already has for us still come before the -ECANCELED
+    void stopRecv(int fd);
+    // sends all of iov, callback gets the bytes sent or a negative errno. the data has
+    // to stay put until the kernel is done with it, which is what hold is for. it's let
+    // go of then, which is later than the callback if the fd is removed in the meantime
+    using SendCallback = util::SmallFunction<void(int)>;
+    bool sendv(int fd, const iovec* iov, int count, std::shared_ptr<void>&& hold, SendCallback&& callback);
+#endif
+
+    // POSIX signals, callback(signo) runs on the loop thread like an fd callback instead
+    // of in a signal handler. adding a signal again replaces its callback, each signal
+    // should only be handled by one loop. with signalfd the signal is blocked in the
+    // calling thread and the loop thread and has to be blocked in every other thread as
+    // well, or those get it the old fashioned way. adding signals in main() before any
+    // threads are started takes care of that since the mask is inherited. it stays
+    // blocked after removeSignal(). without signalfd a handler passes them on over a pipe
+    template<typename T, typename std::enable_if<std::is_invocable_r<void, T, int>::value, T>::type* = nullptr>
+    void addSignal(int signo, T&& callback);
+    void removeSignal(int signo);
+
+    // Hooks run right before the loop waits for fds. idle hooks only when there's nothing
+    // else to do and the loop is about to block, before wait hooks on every iteration.
+    // for batching up flushes, deferred cleanup and the like. a hook can remove itself
+    class Hook
+    {
+    public:
+        Hook();
+        Hook(Hook&& other);
+        Hook& operator=(Hook&& other);
+
+        void remove();
+
+    private:
+        Hook(const Hook&) = delete;
+        Hook& operator=(const Hook&) = delete;
+
+        uint32_t mId;
+        std::weak_ptr<Loop> mLoop;
+
+        friend class Loop;
+    };
+
+    template<typename T, typename std::enable_if<std::is_invocable_r<void, T>::value, T>::type* = nullptr>
+    Hook onIdle(T&& func);
+    template<typename T, typename std::enable_if<std::is_invocable_r<void, T>::value, T>::type* = nullptr>
+    Hook onBeforeWait(T&& func);
+
+    // Busy polling, for loops that care more about wakeup latency than CPU. instead of
+    // going straight to sleep the loop polls the backend without blocking for up to
+    // budget, a budget of 0 turns it off. BusyPollSockets also sets SO_BUSY_POLL to
+    // the budget on every fd added to the loop, where supported
+    enum BusyPollFlag { BusyPollSockets = 0x1 };
+    void setBusyPoll(std::chrono::microseconds budget, uint8_t flags = 0);
+
+    // totals since the loop started. hits are spins that ended with an fd callback run,
+    // wakeups and timers cut a spin short without counting. budget is the spin time
+    // offered, unused is the part of it that was left when there turned out to be
+    // something to do
+    struct BusyPollStats
+    {
+        uint64_t spins { 0 };
+        uint64_t hits { 0 };
+        std::chrono::nanoseconds budget { 0 };
+        std::chrono::nanoseconds unused { 0 };
+    };
+    BusyPollStats busyPollStats() const;
+
+    // Scratch memory for the current iteration, handed back in one go once the loop
+    // is done with a round of events, fds and timers. nothing allocated from it may
+    // outlive the callback that allocated it. arena() is for the loop thread only,
+    // threadArena() is the calling thread's loop's arena or the heap if it has none
+    std::pmr::memory_resource* arena() { return &mArena; }
+    static std::pmr::memory_resource* threadArena();
+
+    // Stall detection, see event/Watchdog.h. while watched the loop notes what it's
+    // dispatching so that whatever keeps it from getting back to waiting can be named
+    enum DispatchKind { DispatchNone, DispatchEvent, DispatchTimer, DispatchFd, DispatchHook };
+    struct Dispatch
+    {
+        DispatchKind kind { DispatchNone };
+        // the callable's type, an fd callback also has its fd
+        const std::type_info* type { nullptr };
+        int fd { -1 };
+        // since the loop last stopped waiting and since the callback started, 0 if not
+        std::chrono::nanoseconds awake { 0 };
+        std::chrono::nanoseconds running { 0 };
+    };
+    // safe to call from any thread, empty unless watched
+    Dispatch dispatch() const;
+
     int execute(std::chrono::milliseconds timeout = std::chrono::milliseconds{-1});
     void exit(int status = 0);
 
+    // Driving the loop from someone else's. instead of execute() the host waits for
+    // fd() to become readable, for at most nextTimeout() (negative means no timer),
+    // and then calls runOnce() which does a single round of events, fds and timers,
+    // waiting for at most timeout if there's nothing to do. call runOnce() once before
+    // waiting for the first time. returns false once the loop has exited. all of these
+    // are for the loop thread only
+    int fd() const;
+    bool runOnce(std::chrono::nanoseconds timeout = std::chrono::nanoseconds{0});
+    std::chrono::nanoseconds nextTimeout();
+
     bool stopped() const { return mStopped.load(std::memory_order_acquire); }
 
     static std::shared_ptr<Loop> loop();
 
 protected:
-    Loop();
+    Loop(ClockMode clock = SteadyClock);
 
 private:
     // nice, three different destroy functions
@@ -152,27 +399,207 @@ private:
     void cleanup();
 
     void wakeup(bool forceWrite = false);
+    void readWakeup();
 
     void commonInit();
 
+    // events other loops batched up for us, see sendBatched(). loop thread only
+    struct Batch
+    {
+        std::weak_ptr<Loop> loop;
+        const Loop* key;
+        Event* head;
+        Event* tail;
+    };
+    class BatchEvent;
+    void batch(Loop* target, Event* event);
+    void flushBatches();
+
+    // one round of execute(), maxWait caps the wait and maxBlock how long a manually
+    // advanced VirtualClock blocks for, negative for no limit. returns 1 to keep
+    // going, 0 when stopped and -1 on error
+    int iterate(std::chrono::nanoseconds maxWait, std::chrono::nanoseconds maxBlock);
+
+    using FdCallback = std::function<void(int, uint8_t)>;
+
+    // mFdTable is indexed by fd and only ever touched on the loop thread, calls from
+    // other threads are posted to it. callbacks are heap allocated so that they stay
+    // put while running, removed callbacks go to mDeadFdCallbacks and removed fds to
+    // mClosingFds until the loop is done dispatching. flags is what the user asked
+    // for, applied is what the backend was last told so that no-op updates never reach it
+    struct FdEntry
+    {
+        std::unique_ptr<FdCallback> callback;
+        uint8_t flags { 0 };
+        uint8_t applied { 0 };
+        bool edgeWrite { false };
+        bool registered { false };
+
+        uint8_t interest() const
+        {
+#if defined(HAVE_IO_URING)
+            // a multishot poll completes on every write space wakeup, not just on edges,
+            // while an update only costs an SQE. so POLLOUT is armed on demand instead
+            return flags;
+#else
+            return edgeWrite ? (flags | FdWrite | FdEdgeWrite) : flags;
+#endif
+        }
+    };
+
+    FD addFdCallback(int fd, uint8_t flags, std::unique_ptr<FdCallback>&& callback);
+    // these must be called on the loop thread
+    FdEntry& fdEntry(int fd);
+    void applyAddFd(int fd, uint8_t flags, std::unique_ptr<FdCallback>&& callback);
+    void applyUpdateFd(int fd, uint8_t flags);
+    void applyRemoveFd(int fd);
+    void applyBusyPollSocket(int fd);
+    void processRetryFds();
+
+    enum HookKind { IdleHook, BeforeWaitHook };
+    using HookFunction = util::SmallFunction<void()>;
+    // heap allocated so that a running hook stays put when others are added, removed
+    // ones are only marked until runHooks() is done
+    struct HookEntry
+    {
+        uint32_t id;
+        bool removed;
+        std::unique_ptr<HookFunction> func;
+    };
+    Hook addHook(HookKind kind, HookFunction&& func);
+    void applyAddHook(HookKind kind, uint32_t id, std::unique_ptr<HookFunction>&& func);
+    void removeHook(uint32_t id);
+    void runHooks();
+
+    using SignalCallback = util::SmallFunction<void(int)>;
+    void addSignalCallback(int signo, std::unique_ptr<SignalCallback>&& callback);
+    // these must be called on the loop thread
+    void applyAddSignal(int signo, std::unique_ptr<SignalCallback>&& callback);
+    void applyRemoveSignal(int signo);
+    void readSignals();
+    void closeSignals();
+
+    // stall tracking for dispatch(), these only record anything while someone's watching
+    void markAwake(bool awake);
+    void beginDispatch(DispatchKind kind, const std::type_info& type, int fd = -1);
+    void beginDispatch(Event* event);
+    void beginDispatch(Timer* timer);
+    void beginDispatch(int fd, FdCallback* callback);
+    void beginDispatch(HookFunction* hook);
+    void endDispatch();
+
+    // shared by all backends, see Loop.cpp
+    bool processEvents();
+    bool hasEvents() const;
+    void reapFds();
+    void processFd(int fd, uint8_t flags);
+    void fireTimers();
+    std::chrono::nanoseconds timerTimeout();
+    bool busyPoll(std::chrono::nanoseconds limit);
+    void adaptMaxEvents(int count);
+    // requires mMutex to be held
+    void scheduleTimer(Timer* timer, TimePoint deadline);
+
+    // implemented by each backend (Loop_epoll.cpp, Loop_kqueue.cpp, Loop_uring.cpp)
+    // flags is a mask of FdRead, FdWrite and FdEdgeWrite. poll returns the number
+    // of events it dispatched or -1 on error. flushFds hands anything the backend
+    // has queued up to the kernel, for when someone else does the waiting
+    void registerFd(int fd, uint8_t flags);
+    void modifyFd(int fd, uint8_t flags);
+    void unregisterFd(int fd);
+    void flushFds();
+    int poll(std::chrono::nanoseconds timeout);
+#if defined(HAVE_IO_URING)
+    // a completion for acceptMultishot(), recvMultishot() or sendv(), true if a
+    // callback was run
+    bool completeOp(uint32_t index, int res, uint32_t flags);
+#endif
+
 private:
-#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL) || defined(HAVE_IO_URING)
     int mFd;
     int mWakeup[2];
 #endif
+#if defined(HAVE_IO_URING)
+    struct Ring;
+    Ring* mRing;
+#endif
+#if defined(HAVE_EPOLL) && defined(HAVE_TIMERFD)
+    // epoll_wait only does whole milliseconds, sub millisecond waits use this instead
+    int mTimerFd;
+#endif
+#if defined(HAVE_KQUEUE)
+    std::vector<struct kevent> mPollEvents;
+#elif defined(HAVE_EPOLL) && !defined(HAVE_IO_URING)
+    std::vector<struct epoll_event> mPollEvents;
+#endif
+    // how many events a single poll may return, grows while polls come back full
+    // and shrinks again once they've been mostly empty for a while
+    enum { MinEvents = 64, MaxEvents = 1024, ShrinkAfter = 32 };
+    int mMaxEvents { MinEvents };
+    int mSmallPolls { 0 };
     std::thread::id mThread;
     std::mutex mMutex;
-    std::vector<std::unique_ptr<Event> > mEvents;
-    std::vector<std::shared_ptr<Timer> > mTimers;
-    std::vector<std::pair<int, std::function<void(int, uint8_t)> > > mFds, mPendingFds;
-    std::vector<std::pair<int, uint8_t> > mUpdateFds;
-    std::vector<int> mRemovedFds;
+    util::MpscQueue<Event, &Event::mNextEvent> mEvents, mUrgentEvents;
+    // bulk events taken from mEvents that didn't fit in the last slice, in order
+    Event* mBulkEvents { nullptr };
+    enum { DefaultBulkSlice = 1024 };
+    size_t mBulkSlice { DefaultBulkSlice };
+    // lets wakeup() skip the syscall unless the loop is about to wait or waiting
+    enum WaitState { Running, Polling, Signaled };
+    std::atomic<int> mWaitState;
+    detail::TimerWheel<Timer> mTimers;
+    std::chrono::nanoseconds mTimerSlack { 0 };
+    std::vector<FdEntry> mFdTable;
+    std::vector<int> mClosingFds;
+    std::vector<std::pair<int, uint8_t> > mRetryFds;
+    std::vector<HookEntry> mIdleHooks, mBeforeWaitHooks;
+    std::atomic<uint32_t> mNextHookId { 0 };
+    bool mHooksRemoved { false };
+    std::vector<std::unique_ptr<FdCallback> > mDeadFdCallbacks;
+    // the signalfd as both ends, or the pipe the signal handler writes signal numbers to.
+    // callbacks are indexed by signal number and go to mDeadSignalCallbacks like fd ones
+    int mSignalFd[2];
+#ifdef HAVE_SIGNALFD
+    sigset_t mSignalMask;
+#endif
+    std::vector<std::unique_ptr<SignalCallback> > mSignalCallbacks, mDeadSignalCallbacks;
+    // busy poll settings are only touched on the loop thread, the stats are read from anywhere
+    std::chrono::nanoseconds mBusyPollBudget { 0 };
+    uint8_t mBusyPollFlags { 0 };
+    std::atomic<uint64_t> mBusyPollSpins { 0 }, mBusyPollHits { 0 };
+    std::atomic<int64_t> mBusyPollOffered { 0 }, mBusyPollUnused { 0 };
+    // fd callbacks run so far, tells a busy poll that found work from one that only
+    // picked up a wakeup or a timer
+    uint64_t mFdDispatches { 0 };
+    // set whenever a timer is added, a spinning loop isn't polling so nobody wakes it
+    // up and it has to look for an earlier deadline itself
+    std::atomic<bool> mTimersAdded { false };
+    // written by the loop thread only while mWatchers is set, times are steady_clock
+    // nanoseconds and 0 means not awake or not dispatching
+    std::atomic<int> mWatchers { 0 };
+    std::atomic<int64_t> mAwakeSince { 0 }, mDispatchSince { 0 };
+    std::atomic<int> mDispatchKind { DispatchNone }, mDispatchFd { -1 };
+    std::atomic<const std::type_info*> mDispatchType { nullptr };
+    pthread_t mPthread;
+    const ClockMode mClockMode;
+    // VirtualClock time in steady_clock nanoseconds
+    std::atomic<int64_t> mVirtualNow { 0 };
+    std::atomic<bool> mAutoAdvance { false };
     std::atomic<bool> mStopped;
     int mStatus;
 
+    util::Arena mArena;
+    std::vector<Batch> mBatches;
+    // inside iterate(), nothing gets batched otherwise. loop thread only
+    bool mIterating { false };
+
     thread_local static std::weak_ptr<Loop> tLoop;
+    thread_local static util::Arena* tArena;
+    static std::atomic<int> sLoops;
 
     friend class Timer;
+    friend class Watchdog;
 };
 
 inline bool Loop::isLoopThread() const
@@ -180,23 +607,30 @@ inline bool Loop::isLoopThread() const
     return mThread == std::this_thread::get_id();
 }
 
+inline std::pmr::memory_resource* Loop::threadArena()
+{
+    // a loop destroyed on some other thread leaves tArena behind
+    if (tArena && !tLoop.expired())
+        return tArena;
+    return std::pmr::new_delete_resource();
+}
+
+inline int Loop::fd() const
+{
+    // the epoll or kqueue fd, or the io_uring ring
+    return mFd;
+}
+
 inline void Loop::Timer::stop()
 {
     std::shared_ptr<Loop> loop = mLoop.lock();
     if (!loop)
         return;
 
+    // release the wheel's reference after unlocking, it might be the last one
+    std::shared_ptr<Timer> ref;
     std::lock_guard<std::mutex> locker(loop->mMutex);
-    auto it = loop->mTimers.begin();
-    const auto end = loop->mTimers.cend();
-    while (it != end) {
-        if (it->get() == this) {
-            // got it
-            loop->mTimers.erase(it);
-            return;
-        }
-        ++it;
-    }
+    ref = loop->mTimers.remove(this);
 }
 
 inline bool Loop::Timer::isActive() const
@@ -206,58 +640,56 @@ inline bool Loop::Timer::isActive() const
         return false;
 
     std::lock_guard<std::mutex> locker(loop->mMutex);
-    auto it = loop->mTimers.begin();
-    const auto end = loop->mTimers.cend();
-    while (it != end) {
-        if (it->get() == this)
-            return true;
-        ++it;
-    }
-    return false;
+    return mWheelSlot != -1;
 }
 
-
 namespace detail {
+using Task = util::SmallFunction<void()>;
+
+// binds the arguments into the task, stored by value like std::bind would
 template<typename T, typename ...Args>
-class ArgsEvent : public Loop::Event
+inline Task bindTask(T&& func, Args&& ...args)
+{
+    if constexpr (sizeof...(Args) == 0) {
+        return Task(std::forward<T>(func));
+    } else {
+        return Task([func = std::forward<T>(func), args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+            std::apply(func, args);
+        });
+    }
+}
+
+class TaskEvent : public Loop::Event
 {
 public:
-    ArgsEvent(T&& f, Args&& ...a) : func(std::forward<T>(f)), args(std::make_tuple(std::forward<Args>(a)...)) { }
-    ArgsEvent(ArgsEvent<T, Args...>&& other) : func(std::move(other.func)), args(std::move(other.args)) { }
-    ~ArgsEvent() override { }
+    TaskEvent(Task&& task) : mTask(std::move(task)) { }
 
-    ArgsEvent<T, Args...>& operator=(ArgsEvent<T, Args...>&& other) { func = std::move(other.func); args = std::move(other.args); return *this; }
+    virtual const std::type_info& type() const override { return mTask.target_type(); }
 
-    virtual void execute() override { std::apply(func, args); }
+    static void* operator new(size_t size) { return util::SizeClassAllocator::allocator().allocate(size); }
+    static void operator delete(void* ptr) { util::SizeClassAllocator::allocator().deallocate(ptr); }
 
-private:
-    ArgsEvent(const ArgsEvent&) = delete;
-    ArgsEvent& operator=(const ArgsEvent&) = delete;
+protected:
+    virtual void execute() override { mTask(); }
 
-    std::function<void(typename std::decay<Args>::type...)> func;
-    std::tuple<typename std::decay<Args>::type...> args;
+private:
+    Task mTask;
 };
 
-template<typename T, typename ...Args>
-class ArgsTimer : public Loop::Timer
+class TaskTimer : public Loop::Timer
 {
 public:
-    ArgsTimer(std::chrono::milliseconds timeout, Loop::TimerFlag flag, T&& f, Args&& ...a)
-        : Timer(timeout, flag), func(std::forward<T>(f)), args(std::make_tuple(std::forward<Args>(a)...))
+    TaskTimer(std::chrono::nanoseconds timeout, Loop::TimerFlag flag, Task&& task)
+        : Timer(timeout, flag), mTask(std::move(task))
     { }
-    ArgsTimer(ArgsTimer<T, Args...>&& other) : func(std::move(other.func)), args(std::move(other.args)) { }
-    ~ArgsTimer() override { }
 
-    ArgsTimer<T, Args...>& operator=(ArgsTimer<T, Args...>&& other) { func = std::move(other.func); args = std::move(other.args); return *this; }
+    virtual const std::type_info& type() const override { return mTask.target_type(); }
 
-    virtual void execute() override { std::apply(func, args); }
+protected:
+    virtual void execute() override { mTask(); }
 
 private:
-    ArgsTimer(const ArgsTimer&) = delete;
-    ArgsTimer& operator=(const ArgsTimer&) = delete;
-
-    std::function<void(typename std::decay<Args>::type...)> func;
-    std::tuple<typename std::decay<Args>::type...> args;
+    Task mTask;
 };
 } // namespace detail
 
@@ -268,8 +700,29 @@ Loop::send(T&& func, Args&& ...args)
     if (mThread == std::this_thread::get_id()) {
         func(std::forward<Args>(args)...);
     } else {
-        std::unique_ptr<detail::ArgsEvent<T, Args...> > event = std::make_unique<detail::ArgsEvent<T, Args...> >(std::forward<T>(func), std::forward<Args>(args)...);
-        post(std::move(event));
+        post(std::unique_ptr<Event>(new detail::TaskEvent(detail::bindTask(std::forward<T>(func), std::forward<Args>(args)...))));
+    }
+}
+
+template<typename T, typename ...Args>
+inline typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
+Loop::send(Priority priority, T&& func, Args&& ...args)
+{
+    if (mThread == std::this_thread::get_id()) {
+        func(std::forward<Args>(args)...);
+    } else {
+        post(std::unique_ptr<Event>(new detail::TaskEvent(detail::bindTask(std::forward<T>(func), std::forward<Args>(args)...))), priority);
+    }
+}
+
+template<typename T, typename ...Args>
+inline typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
+Loop::sendBatched(T&& func, Args&& ...args)
+{
+    if (mThread == std::this_thread::get_id()) {
+        func(std::forward<Args>(args)...);
+    } else {
+        sendBatched(std::unique_ptr<Event>(new detail::TaskEvent(detail::bindTask(std::forward<T>(func), std::forward<Args>(args)...))));
     }
 }
 
@@ -283,12 +736,12 @@ inline void Loop::send(T&& event)
     }
 }
 
-inline void Loop::send(std::unique_ptr<Event>&& event)
+inline void Loop::send(std::unique_ptr<Event>&& event, Priority priority)
 {
     if (mThread == std::this_thread::get_id()) {
         event->execute();
     } else {
-        post(std::move(event));
+        post(std::move(event), priority);
     }
 }
 
@@ -296,8 +749,14 @@ template<typename T, typename ...Args>
 inline typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
 Loop::post(T&& func, Args&& ...args)
 {
-    std::unique_ptr<detail::ArgsEvent<T, Args...> > event = std::make_unique<detail::ArgsEvent<T, Args...> >(std::forward<T>(func), std::forward<Args>(args)...);
-    post(std::move(event));
+    post(std::unique_ptr<Event>(new detail::TaskEvent(detail::bindTask(std::forward<T>(func), std::forward<Args>(args)...))));
+}
+
+template<typename T, typename ...Args>
+inline typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, void>::type
+Loop::post(Priority priority, T&& func, Args&& ...args)
+{
+    post(std::unique_ptr<Event>(new detail::TaskEvent(detail::bindTask(std::forward<T>(func), std::forward<Args>(args)...))), priority);
 }
 
 template<typename T, typename std::enable_if<std::is_base_of<Loop::Event, T>::value, T>::type*>
@@ -306,18 +765,44 @@ inline void Loop::post(T&& event)
     post(std::make_unique<Event>(new T(std::forward<T>(event))));
 }
 
-inline void Loop::post(std::unique_ptr<Event>&& event)
+inline void Loop::post(std::unique_ptr<Event>&& event, Priority priority)
 {
-    std::lock_guard<std::mutex> locker(mMutex);
-    mEvents.push_back(std::move(event));
+    if (priority == Urgent) {
+        mUrgentEvents.push(event.release());
+    } else {
+        mEvents.push(event.release());
+    }
     wakeup();
 }
 
+inline void Loop::sendBatched(std::unique_ptr<Event>&& event)
+{
+    if (mThread == std::this_thread::get_id()) {
+        event->execute();
+        return;
+    }
+    // held by the loop running on this thread, if any, until its iteration is done
+    auto source = tLoop.lock();
+    if (!source || !source->mIterating) {
+        post(std::move(event));
+        return;
+    }
+    source->batch(this, event.release());
+}
+
+inline void Loop::setBulkSlice(size_t slice)
+{
+    assert(isLoopThread());
+    assert(slice > 0);
+    mBulkSlice = slice;
+}
+
 template<typename T, typename ...Args>
 typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, std::shared_ptr<Loop::Timer> >::type
-Loop::addTimer(std::chrono::milliseconds timeout, T&& func, Args&& ...args)
+Loop::addTimer(std::chrono::nanoseconds timeout, T&& func, Args&& ...args)
 {
-    auto st = std::make_shared<detail::ArgsTimer<T, Args...> >(timeout, Timeout, std::forward<T>(func), std::forward<Args>(args)...);
+    auto st = std::allocate_shared<detail::TaskTimer>(util::SizeClassStdAllocator<detail::TaskTimer>(), timeout, Timeout,
+                                                      detail::bindTask(std::forward<T>(func), std::forward<Args>(args)...));
     st->mLoop = shared_from_this();
     addTimer(st);
     return st;
@@ -325,103 +810,102 @@ Loop::addTimer(std::chrono::milliseconds timeout, T&& func, Args&& ...args)
 
 template<typename T, typename ...Args>
 typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, std::shared_ptr<Loop::Timer> >::type
-Loop::addTimer(std::chrono::milliseconds timeout, TimerFlag flag, T&& func, Args&& ...args)
+Loop::addTimer(std::chrono::nanoseconds timeout, TimerFlag flag, T&& func, Args&& ...args)
 {
-    auto st = std::make_shared<detail::ArgsTimer<T, Args...> >(timeout, flag, std::forward<T>(func), std::forward<Args>(args)...);
+    auto st = std::allocate_shared<detail::TaskTimer>(util::SizeClassStdAllocator<detail::TaskTimer>(), timeout, flag,
+                                                      detail::bindTask(std::forward<T>(func), std::forward<Args>(args)...));
     st->mLoop = shared_from_this();
     addTimer(st);
     return st;
 }
 
-inline void Loop::addTimer(std::shared_ptr<Timer>&& t)
+template<typename T, typename ...Args>
+typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, std::shared_ptr<Loop::Timer> >::type
+Loop::addTimerAt(TimePoint deadline, T&& func, Args&& ...args)
 {
-    t->mNext = std::chrono::steady_clock::now() + t->mTimeout;
-    t->mLoop = shared_from_this();
-
-    std::lock_guard<std::mutex> locker(mMutex);
-
-    // we need our timer list to be sorted
-    auto compare = [](const std::shared_ptr<Timer>& a, const std::shared_ptr<Timer>& b) -> bool {
-        return a->mNext < b->mNext;
-    };
-    auto it = std::lower_bound(mTimers.begin(), mTimers.end(), t, compare);
-    mTimers.insert(it, std::move(t));
+    auto st = std::allocate_shared<detail::TaskTimer>(util::SizeClassStdAllocator<detail::TaskTimer>(), std::chrono::nanoseconds{0}, Timeout,
+                                                      detail::bindTask(std::forward<T>(func), std::forward<Args>(args)...));
+    addTimerAt(st, deadline);
+    return st;
+}
 
-    wakeup();
+inline void Loop::addTimer(std::shared_ptr<Timer>&& t)
+{
+    const auto next = now() + t->mTimeout;
+    addTimerAt(std::move(t), next);
 }
 
 inline void Loop::addTimer(const std::shared_ptr<Timer>& t)
 {
-    t->mNext = std::chrono::steady_clock::now() + t->mTimeout;
+    addTimer(std::shared_ptr<Timer>(t));
+}
+
+inline void Loop::addTimerAt(std::shared_ptr<Timer>&& t, TimePoint deadline)
+{
     t->mLoop = shared_from_this();
 
+    std::shared_ptr<Timer> ref;
     std::lock_guard<std::mutex> locker(mMutex);
 
-    // we need our timer list to be sorted
-    auto compare = [](const std::shared_ptr<Timer>& a, const std::shared_ptr<Timer>& b) -> bool {
-        return a->mNext < b->mNext;
-    };
-    auto it = std::lower_bound(mTimers.begin(), mTimers.end(), t, compare);
-    mTimers.insert(it, t);
+    // adding an active timer reschedules it
+    ref = mTimers.remove(t.get());
+    scheduleTimer(t.get(), deadline);
+    mTimers.insert(std::move(t));
 
+    mTimersAdded.store(true, std::memory_order_relaxed);
     wakeup();
 }
 
-template<typename T, typename std::enable_if<std::is_invocable_r<void, T, int, uint8_t>::value, T>::type*>
-inline Loop::FD Loop::addFd(int fd, uint8_t flags, T&& callback)
+inline void Loop::addTimerAt(const std::shared_ptr<Timer>& t, TimePoint deadline)
 {
-    assert(!(flags & FdError));
-
-    FD r;
-    r.mFd = fd;
-    r.mLoop = shared_from_this();
+    addTimerAt(std::shared_ptr<Timer>(t), deadline);
+}
 
-    std::lock_guard<std::mutex> locker(mMutex);
-    mPendingFds.push_back(std::make_pair(fd, std::forward<T>(callback)));
-    if (flags & FdWrite) {
-        mUpdateFds.push_back(std::make_pair(fd, FdWrite | ((flags & FdRead) ? FdRead : 0)));
-    }
-    // take it out of mRemovedFds if it exists
-    auto rit = std::find(mRemovedFds.begin(), mRemovedFds.end(), fd);
-    if (rit != mRemovedFds.end()) {
-        mRemovedFds.erase(rit);
+inline void Loop::scheduleTimer(Timer* t, TimePoint deadline)
+{
+    t->mDeadline = deadline;
+    const auto slack = t->mSlack < std::chrono::nanoseconds{0} ? mTimerSlack : t->mSlack;
+    if (slack <= std::chrono::nanoseconds{0}) {
+        t->mNext = deadline;
+        return;
     }
-    wakeup();
+    // round up to the next multiple of the slack, everyone with the same slack lands on the same boundaries
+    const auto since = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+    const auto rounded = ((since + slack - std::chrono::nanoseconds{1}) / slack) * slack;
+    t->mNext = TimePoint(std::chrono::duration_cast<TimePoint::duration>(rounded));
+}
 
-    return r;
+template<typename T, typename std::enable_if<std::is_invocable_r<void, T, int, uint8_t>::value, T>::type*>
+inline Loop::FD Loop::addFd(int fd, uint8_t flags, T&& callback)
+{
+    return addFdCallback(fd, flags, std::make_unique<FdCallback>(std::forward<T>(callback)));
 }
 
 template<typename T, typename std::enable_if<std::is_invocable_r<void, T, int, uint8_t>::value, T>::type*>
 inline Loop::FD Loop::addFd(int fd, uint8_t flags, const T& callback)
 {
-    assert(!(flags & FdError));
-
-    FD r;
-    r.mFd = fd;
-    r.mLoop = shared_from_this();
-
-    std::lock_guard<std::mutex> locker(mMutex);
-    mPendingFds.push_back(std::make_pair(fd, callback));
-    if (flags & FdWrite) {
-        mUpdateFds.push_back(std::make_pair(fd, FdWrite | ((flags & FdRead) ? FdRead : 0)));
-    }
-    // take it out of mRemovedFds if it exists
-    auto rit = std::find(mRemovedFds.begin(), mRemovedFds.end(), fd);
-    if (rit != mRemovedFds.end()) {
-        mRemovedFds.erase(rit);
-    }
-    wakeup();
+    return addFdCallback(fd, flags, std::make_unique<FdCallback>(callback));
+}
 
-    return r;
+inline Loop::FdEntry& Loop::fdEntry(int fd)
+{
+    assert(fd >= 0);
+    if (static_cast<size_t>(fd) >= mFdTable.size())
+        mFdTable.resize(fd + 1);
+    return mFdTable[fd];
 }
 
 inline void Loop::updateFd(int fd, uint8_t flags)
 {
-    assert(!(flags & FdError));
+    assert(!(flags & (FdError | FdEdgeWrite)));
 
-    std::lock_guard<std::mutex> locker(mMutex);
-    mUpdateFds.push_back(std::make_pair(fd, flags));
-    wakeup();
+    if (isLoopThread()) {
+        applyUpdateFd(fd, flags);
+        return;
+    }
+    post([this, fd, flags]() {
+        applyUpdateFd(fd, flags);
+    });
 }
 
 inline Loop::FD::FD()
@@ -443,37 +927,13 @@ inline Loop::FD& Loop::FD::operator=(FD&& other)
 
 inline void Loop::removeFd(int fd)
 {
-    std::lock_guard<std::mutex> locker(mMutex);
-    auto it = mFds.begin();
-    auto end = mFds.cend();
-    while (it != end) {
-        if (it->first == fd) {
-            mFds.erase(it);
-            break;
-        }
-        ++it;
-    }
-    it = mPendingFds.begin();
-    end = mPendingFds.cend();
-    while (it != end) {
-        if (it->first == fd) {
-            mPendingFds.erase(it);
-            break;
-        }
-        ++it;
-    }
-    // remove from mUpdateFds if it's there
-    auto uit = mUpdateFds.begin();
-    const auto uend = mUpdateFds.cend();
-    while (uit != uend) {
-        if (uit->first == fd) {
-            mUpdateFds.erase(uit);
-            break;
-        }
-        ++uit;
+    if (isLoopThread()) {
+        applyRemoveFd(fd);
+        return;
     }
-    mRemovedFds.push_back(fd);
-    wakeup();
+    post([this, fd]() {
+        applyRemoveFd(fd);
+    });
 }
 
 inline void Loop::FD::remove()
@@ -487,14 +947,151 @@ inline void Loop::FD::remove()
     mFd = -1;
 }
 
+template<typename T, typename std::enable_if<std::is_invocable_r<void, T, int>::value, T>::type*>
+inline void Loop::addSignal(int signo, T&& callback)
+{
+    addSignalCallback(signo, std::make_unique<SignalCallback>(std::forward<T>(callback)));
+}
+
+template<typename T, typename std::enable_if<std::is_invocable_r<void, T>::value, T>::type*>
+inline Loop::Hook Loop::onIdle(T&& func)
+{
+    return addHook(IdleHook, HookFunction(std::forward<T>(func)));
+}
+
+template<typename T, typename std::enable_if<std::is_invocable_r<void, T>::value, T>::type*>
+inline Loop::Hook Loop::onBeforeWait(T&& func)
+{
+    return addHook(BeforeWaitHook, HookFunction(std::forward<T>(func)));
+}
+
+inline Loop::Hook::Hook()
+    : mId(0)
+{
+}
+
+inline Loop::Hook::Hook(Hook&& other)
+    : mId(other.mId), mLoop(std::move(other.mLoop))
+{
+    other.mId = 0;
+}
+
+inline Loop::Hook& Loop::Hook::operator=(Hook&& other)
+{
+    mId = other.mId;
+    mLoop = std::move(other.mLoop);
+    other.mId = 0;
+    return *this;
+}
+
+inline void Loop::Hook::remove()
+{
+    if (!mId)
+        return;
+    auto loop = mLoop.lock();
+    if (!loop)
+        return;
+    loop->removeHook(mId);
+    mId = 0;
+}
+
+inline Loop::BusyPollStats Loop::busyPollStats() const
+{
+    BusyPollStats stats;
+    stats.spins = mBusyPollSpins.load(std::memory_order_relaxed);
+    stats.hits = mBusyPollHits.load(std::memory_order_relaxed);
+    stats.budget = std::chrono::nanoseconds{mBusyPollOffered.load(std::memory_order_relaxed)};
+    stats.unused = std::chrono::nanoseconds{mBusyPollUnused.load(std::memory_order_relaxed)};
+    return stats;
+}
+
+static inline int64_t steadyNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void Loop::markAwake(bool awake)
+{
+    // clearing is unconditional so that nothing stale is left behind once unwatched.
+    // the backends dispatch fds from inside poll(), those have already marked us awake
+    if (!awake) {
+        mAwakeSince.store(0, std::memory_order_release);
+    } else if (mWatchers.load(std::memory_order_relaxed) && !mAwakeSince.load(std::memory_order_relaxed)) {
+        mAwakeSince.store(steadyNanoseconds(), std::memory_order_release);
+    }
+}
+
+inline void Loop::beginDispatch(DispatchKind kind, const std::type_info& type, int fd)
+{
+    if (!mWatchers.load(std::memory_order_relaxed))
+        return;
+    markAwake(true);
+    mDispatchKind.store(kind, std::memory_order_relaxed);
+    mDispatchType.store(&type, std::memory_order_relaxed);
+    mDispatchFd.store(fd, std::memory_order_relaxed);
+    // published last, dispatch() checks that it didn't change while reading the rest
+    mDispatchSince.store(steadyNanoseconds(), std::memory_order_release);
+}
+
+inline void Loop::beginDispatch(Event* event)
+{
+    if (mWatchers.load(std::memory_order_relaxed))
+        beginDispatch(DispatchEvent, event->type());
+}
+
+inline void Loop::beginDispatch(Timer* timer)
+{
+    if (mWatchers.load(std::memory_order_relaxed))
+        beginDispatch(DispatchTimer, timer->type());
+}
+
+inline void Loop::beginDispatch(int fd, FdCallback* callback)
+{
+    if (mWatchers.load(std::memory_order_relaxed))
+        beginDispatch(DispatchFd, callback->target_type(), fd);
+}
+
+inline void Loop::beginDispatch(HookFunction* hook)
+{
+    if (mWatchers.load(std::memory_order_relaxed))
+        beginDispatch(DispatchHook, hook->target_type());
+}
+
+inline void Loop::endDispatch()
+{
+    mDispatchSince.store(0, std::memory_order_release);
+}
+
 inline std::shared_ptr<Loop> Loop::loop()
 {
     return tLoop.lock();
 }
 
+inline Loop::TimePoint Loop::now() const
+{
+    if (mClockMode == SteadyClock)
+        return std::chrono::steady_clock::now();
+    return TimePoint(std::chrono::duration_cast<TimePoint::duration>(std::chrono::nanoseconds{mVirtualNow.load(std::memory_order_acquire)}));
+}
+
+inline void Loop::advance(std::chrono::nanoseconds by)
+{
+    advanceTo(now() + by);
+}
+
+inline void Loop::setAutoAdvance(bool autoAdvance)
+{
+    assert(mClockMode == VirtualClock);
+    mAutoAdvance.store(autoAdvance, std::memory_order_relaxed);
+    wakeup();
+}
+
+// milliseconds by the clock of the current thread's loop, steady_clock without one
 static inline int64_t timeNow()
 {
-    return std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()).time_since_epoch().count();
+    const auto loop = Loop::loop();
+    const auto now = loop ? loop->now() : std::chrono::steady_clock::now();
+    return std::chrono::time_point_cast<std::chrono::milliseconds>(now).time_since_epoch().count();
 }
 
 }} // namespace reckoning::event
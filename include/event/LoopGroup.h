@@ -0,0 +1,102 @@
+#ifndef LOOPGROUP_H
+#define LOOPGROUP_H
+
+#include <event/Loop.h>
+#include <util/Creatable.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace reckoning {
+namespace event {
+
+// A fixed set of event loops, each running on its own thread. By default there's one
+// loop per cpu the process may run on and each thread is pinned to one of those cpus
+// where the platform allows it.
+// cpus replaces that, loop i is then restricted to cpus[i % cpus.size()], eg the cores
+// of the NUMA node the NIC is attached to. LocalMemory has each loop thread allocate
+// from the node it's pinned to, so the loop, its arena and its buffer and object pools
+// stay local to it even when the process runs with an interleaving memory policy.
+// threads are named name followed by their index
+class LoopGroup : public std::enable_shared_from_this<LoopGroup>, public util::Creatable<LoopGroup>
+{
+public:
+    enum Flag { NoPinning = 0x1, LocalMemory = 0x2 };
+    using CpuSet = std::vector<unsigned int>;
+
+    ~LoopGroup();
+
+    void init();
+
+    size_t size() const { return mLoops.size(); }
+    const std::shared_ptr<Loop>& loop(size_t index) const { return mLoops[index]; }
+    const std::vector<std::shared_ptr<Loop> >& loops() const { return mLoops; }
+
+    // round robin, for spreading out work that isn't tied to a particular loop
+    const std::shared_ptr<Loop>& next();
+
+    // runs func(loop) on each loop, on that loop's thread
+    template<typename T>
+    void forEach(T&& func);
+
+    // exits all loops and waits for the threads to finish, can't be called from one of our loops
+    void stop(int status = 0);
+
+protected:
+    LoopGroup(size_t count = 0, unsigned int flags = 0, std::vector<CpuSet> cpus = {}, std::string name = "loop");
+
+private:
+    LoopGroup(const LoopGroup&) = delete;
+    LoopGroup& operator=(const LoopGroup&) = delete;
+
+    void run(size_t index);
+
+private:
+    size_t mCount;
+    unsigned int mFlags;
+    std::vector<CpuSet> mCpus;
+    // the cpus we're allowed on, for default pinning
+    CpuSet mAllowed;
+    std::string mName;
+    std::vector<std::shared_ptr<Loop> > mLoops;
+    std::vector<std::thread> mThreads;
+    std::atomic<size_t> mNext;
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    size_t mStarted;
+};
+
+inline LoopGroup::LoopGroup(size_t count, unsigned int flags, std::vector<CpuSet> cpus, std::string name)
+    : mCount(count), mFlags(flags), mCpus(std::move(cpus)), mName(std::move(name)), mNext(0), mStarted(0)
+{
+}
+
+inline LoopGroup::~LoopGroup()
+{
+    stop();
+}
+
+inline const std::shared_ptr<Loop>& LoopGroup::next()
+{
+    return mLoops[mNext.fetch_add(1, std::memory_order_relaxed) % mLoops.size()];
+}
+
+template<typename T>
+inline void LoopGroup::forEach(T&& func)
+{
+    for (const auto& loop : mLoops) {
+        loop->send([func, loop]() -> void {
+            func(loop);
+        });
+    }
+}
+
+}} // namespace reckoning::event
+
+#endif // LOOPGROUP_H
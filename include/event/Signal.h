@@ -6,8 +6,11 @@
 #include <util/Invocable.h>
 #include <event/Loop.h>
 #include <cassert>
+#include <atomic>
 #include <memory>
 #include <functional>
+#include <thread>
+#include <vector>
 
 namespace reckoning {
 namespace event {
@@ -29,10 +32,26 @@ public:
 private:
     std::function<void(typename std::decay<Args>::type...)> mFunction;
     std::weak_ptr<Loop> mLoop;
+    // the loop's thread, emits on it call straight through
+    std::thread::id mThread;
+    bool mBatched;
     std::atomic<bool> mConnected;
 
     friend class Signal<Args...>;
 };
+
+// immutable once published, connecting or pruning makes a new one. each emit holds a
+// reference for as long as it's walking the list so that a callback can disconnect,
+// connect or even destroy the signal without pulling it out from under us
+template<typename ...Args>
+struct ConnectionList
+{
+    std::vector<std::shared_ptr<ConnectionBase<Args...> > > connections;
+    // one for the signal plus one per emit in progress
+    std::atomic<uint32_t> refs { 1 };
+    // set by an emit that came across a disconnected connection
+    std::atomic<bool> dead { false };
+};
 } // namespace detail
 
 template<typename ...Args>
@@ -61,9 +80,14 @@ public:
         friend class Signal;
     };
 
+    // Batched connections on another loop get their calls through Loop::sendBatched(),
+    // when emitted from a loop thread that means at most two wakeups per emitting
+    // iteration instead of one per emit
+    enum Flag { Batched = 0x1 };
+
     template<typename T>
     typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, Connection>::type
-    connect(T&& func);
+    connect(T&& func, uint8_t flags = 0);
     void disconnect();
     void emit(Args&& ...args);
 
@@ -71,23 +95,40 @@ private:
     Signal(const Signal&) = delete;
     Signal& operator=(const Signal&) = delete;
 
-    std::vector<std::shared_ptr<detail::ConnectionBase<Args...> > > mConnections;
+    using List = detail::ConnectionList<Args...>;
+
+    // takes a reference to the current list, pruning it first if needed
+    List* acquire();
+    static void release(List* list);
+    // these require mLock to be held
+    List* live(size_t extra) const;
+    void replace(List* list);
+
+    List* mConnections { nullptr };
     util::SpinLock mLock;
 };
 
 namespace detail {
 template<typename ...Args>
 ConnectionBase<Args...>::ConnectionBase()
-    : mConnected(true)
+    : mBatched(false), mConnected(true)
 {
 }
 
 template<typename ...Args>
 void ConnectionBase<Args...>::invoke(Args&& ...args)
 {
+    if (mThread == std::this_thread::get_id()) {
+        mFunction(std::forward<Args>(args)...);
+        return;
+    }
     auto loop = mLoop.lock();
     if (loop) {
-        loop->send(mFunction, std::forward<Args>(args)...);
+        if (mBatched) {
+            loop->sendBatched(mFunction, std::forward<Args>(args)...);
+        } else {
+            loop->send(mFunction, std::forward<Args>(args)...);
+        }
     } else {
         mFunction(std::forward<Args>(args)...);
     }
@@ -143,19 +184,25 @@ inline Signal<Args...>::Signal()
 
 template<typename ...Args>
 inline Signal<Args...>::Signal(Signal&& other)
-    : mConnections(std::move(other.mConnections)), mLock(std::move(other.mLock))
+    : mConnections(other.mConnections), mLock(std::move(other.mLock))
 {
+    other.mConnections = nullptr;
 }
 
 template<typename ...Args>
 inline Signal<Args...>::~Signal()
 {
+    if (mConnections)
+        release(mConnections);
 }
 
 template<typename ...Args>
 inline Signal<Args...>& Signal<Args...>::operator=(Signal&& other)
 {
-    mConnections = std::move(other.mConnections);
+    if (mConnections)
+        release(mConnections);
+    mConnections = other.mConnections;
+    other.mConnections = nullptr;
     mLock = std::move(other.mLock);
     return *this;
 }
@@ -164,48 +211,92 @@ template<typename ...Args>
 inline void Signal<Args...>::disconnect()
 {
     util::SpinLocker locker(mLock);
-    mConnections.clear();
+    replace(nullptr);
 }
 
 template<typename ...Args>
-inline void Signal<Args...>::emit(Args&& ...args)
+inline typename Signal<Args...>::List* Signal<Args...>::live(size_t extra) const
 {
-    std::vector<std::shared_ptr<detail::ConnectionBase<Args...> > > connections;
-    {
-        util::SpinLocker locker(mLock);
-        auto it = mConnections.begin();
-        auto end = mConnections.cend();
-        while (it != end) {
-            if ((*it)->connected()) {
-                connections.push_back(*it);
-                ++it;
-            } else {
-                it = mConnections.erase(it);
-                end = mConnections.cend();
-            }
+    List* list = new List;
+    if (mConnections) {
+        list->connections.reserve(mConnections->connections.size() + extra);
+        for (const auto& conn : mConnections->connections) {
+            if (conn->connected())
+                list->connections.push_back(conn);
         }
     }
-    for (const auto& conn : connections) {
-        if (!conn->connected())
+    return list;
+}
+
+template<typename ...Args>
+inline void Signal<Args...>::replace(List* list)
+{
+    if (list && list->connections.empty()) {
+        delete list;
+        list = nullptr;
+    }
+    List* old = mConnections;
+    mConnections = list;
+    if (old)
+        release(old);
+}
+
+template<typename ...Args>
+inline typename Signal<Args...>::List* Signal<Args...>::acquire()
+{
+    util::SpinLocker locker(mLock);
+    if (mConnections && mConnections->dead.load(std::memory_order_relaxed))
+        replace(live(0));
+    List* list = mConnections;
+    if (list)
+        list->refs.fetch_add(1, std::memory_order_relaxed);
+    return list;
+}
+
+template<typename ...Args>
+inline void Signal<Args...>::release(List* list)
+{
+    if (list->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete list;
+}
+
+template<typename ...Args>
+inline void Signal<Args...>::emit(Args&& ...args)
+{
+    List* list = acquire();
+    if (!list)
+        return;
+    // nothing below touches this, a callback might have destroyed us
+    for (const auto& conn : list->connections) {
+        if (!conn->connected()) {
+            // the next emit prunes it
+            list->dead.store(true, std::memory_order_relaxed);
             continue;
+        }
         // there's a race here, the connection can get disconnected between the time
         // we asked if it was connected above and to here where we actually invoke.
         // but we can live with that.
         conn->invoke(std::forward<Args>(args)...);
     }
+    release(list);
 }
 
 template<typename ...Args>
 template<typename T>
 inline typename std::enable_if<std::is_invocable_r<void, T, Args...>::value, typename Signal<Args...>::Connection>::type
-Signal<Args...>::connect(T&& func)
+Signal<Args...>::connect(T&& func, uint8_t flags)
 {
-    util::SpinLocker locker(mLock);
-
     auto base = std::make_shared<detail::ConnectionBase<Args...> >();
     base->mLoop = Loop::loop();
+    if (!base->mLoop.expired())
+        base->mThread = std::this_thread::get_id();
     base->mFunction = std::forward<T>(func);
-    mConnections.push_back(base);
+    base->mBatched = (flags & Batched) != 0;
+
+    util::SpinLocker locker(mLock);
+    List* list = live(1);
+    list->connections.push_back(base);
+    replace(list);
     return Connection(base);
 }
 
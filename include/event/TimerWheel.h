@@ -0,0 +1,323 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace reckoning {
+namespace event {
+namespace detail {
+
+// Hierarchical timing wheel (Varghese & Lauck). A root wheel of 256 slots one tick wide,
+// followed by four levels of 64 slots where each slot spans a whole rotation of the level
+// below it. Timers are kept in intrusive lists so insert and remove are O(1), and expiring
+// only touches the slots that have come due plus an occasional cascade of a higher level
+// slot down into the lower ones.
+//
+// T needs to provide mNext (the deadline), mWheelPrev, mWheelNext, mWheelSlot and
+// mWheelRef (the reference that keeps the timer alive while it's scheduled).
+//
+// Not thread safe, Loop protects it with its mutex.
+template<typename T>
+class TimerWheel
+{
+public:
+    using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
+
+    TimerWheel(std::chrono::nanoseconds resolution = std::chrono::milliseconds{1});
+    ~TimerWheel();
+
+    std::chrono::nanoseconds resolution() const { return mResolution; }
+    void setResolution(std::chrono::nanoseconds resolution);
+
+    bool empty() const { return !mCount; }
+    size_t size() const { return mCount; }
+
+    void insert(std::shared_ptr<T>&& timer);
+    // returns the reference the wheel held so the caller can control where it's released
+    std::shared_ptr<T> remove(T* timer);
+    void clear();
+
+    // the earliest time the wheel needs to be expired, either the deadline of the first
+    // timer or the time a higher level slot needs to be cascaded. TimePoint::max() if empty
+    TimePoint next() const;
+
+    // calls func for every timer with a deadline at or before now. func must not modify the wheel
+    template<typename Func>
+    void expire(TimePoint now, Func&& func);
+
+private:
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    enum {
+        RootBits = 8,
+        LevelBits = 6,
+        Levels = 4,
+        RootSize = 1 << RootBits,
+        RootMask = RootSize - 1,
+        LevelSize = 1 << LevelBits,
+        LevelMask = LevelSize - 1,
+        SlotCount = RootSize + Levels * LevelSize
+    };
+
+    uint64_t tick(TimePoint time) const { return time.time_since_epoch() / mResolution; }
+    TimePoint time(uint64_t tick) const { return TimePoint(std::chrono::duration_cast<TimePoint::duration>(mResolution * tick)); }
+
+    void place(T* timer);
+    void link(T* timer, int slot);
+    void unlink(T* timer);
+    void cascade();
+    int findRoot(unsigned int from) const;
+    template<typename Func>
+    void expireSlot(unsigned int slot, TimePoint now, bool all, Func& func);
+
+private:
+    std::chrono::nanoseconds mResolution;
+    uint64_t mCurrent;
+    size_t mCount { 0 };
+    std::array<T*, SlotCount> mSlots {};
+    // one bit per slot, the root wheel gets the first four words and each level one word after that
+    std::array<uint64_t, SlotCount / 64> mOccupied {};
+    std::vector<T*> mScratch;
+};
+
+template<typename T>
+inline TimerWheel<T>::TimerWheel(std::chrono::nanoseconds resolution)
+    : mResolution(resolution)
+{
+    mCurrent = tick(std::chrono::steady_clock::now());
+}
+
+template<typename T>
+inline TimerWheel<T>::~TimerWheel()
+{
+    clear();
+}
+
+template<typename T>
+inline void TimerWheel<T>::setResolution(std::chrono::nanoseconds resolution)
+{
+    assert(empty());
+    assert(resolution.count() > 0);
+    const auto now = time(mCurrent);
+    mResolution = resolution;
+    mCurrent = tick(now);
+}
+
+template<typename T>
+inline void TimerWheel<T>::link(T* timer, int slot)
+{
+    timer->mWheelSlot = slot;
+    timer->mWheelPrev = nullptr;
+    timer->mWheelNext = mSlots[slot];
+    if (timer->mWheelNext)
+        timer->mWheelNext->mWheelPrev = timer;
+    mSlots[slot] = timer;
+    mOccupied[slot / 64] |= 1ULL << (slot % 64);
+}
+
+template<typename T>
+inline void TimerWheel<T>::unlink(T* timer)
+{
+    const int slot = timer->mWheelSlot;
+    assert(slot >= 0);
+    if (timer->mWheelPrev) {
+        timer->mWheelPrev->mWheelNext = timer->mWheelNext;
+    } else {
+        mSlots[slot] = timer->mWheelNext;
+        if (!mSlots[slot])
+            mOccupied[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+    if (timer->mWheelNext)
+        timer->mWheelNext->mWheelPrev = timer->mWheelPrev;
+    timer->mWheelPrev = timer->mWheelNext = nullptr;
+    timer->mWheelSlot = -1;
+}
+
+template<typename T>
+inline void TimerWheel<T>::place(T* timer)
+{
+    // anything already overdue goes in the current slot
+    uint64_t when = timer->mNext < time(mCurrent) ? mCurrent : tick(timer->mNext);
+    const uint64_t delta = when - mCurrent;
+    if (delta < RootSize) {
+        link(timer, when & RootMask);
+        return;
+    }
+    int level = 1;
+    int shift = RootBits;
+    while (level < Levels && delta >= (1ULL << (shift + LevelBits))) {
+        ++level;
+        shift += LevelBits;
+    }
+    if (delta >= (1ULL << (shift + LevelBits))) {
+        // further out than the wheel reaches, park it in the last slot we can reach.
+        // it'll be placed again when that slot cascades
+        when = mCurrent + (1ULL << (shift + LevelBits)) - 1;
+    }
+    link(timer, RootSize + (level - 1) * LevelSize + ((when >> shift) & LevelMask));
+}
+
+template<typename T>
+inline void TimerWheel<T>::insert(std::shared_ptr<T>&& timer)
+{
+    T* t = timer.get();
+    assert(t->mWheelSlot == -1);
+    t->mWheelRef = std::move(timer);
+    place(t);
+    ++mCount;
+}
+
+template<typename T>
+inline std::shared_ptr<T> TimerWheel<T>::remove(T* timer)
+{
+    if (timer->mWheelSlot == -1)
+        return std::shared_ptr<T>();
+    unlink(timer);
+    --mCount;
+    return std::move(timer->mWheelRef);
+}
+
+template<typename T>
+inline void TimerWheel<T>::clear()
+{
+    std::vector<std::shared_ptr<T> > refs;
+    refs.reserve(mCount);
+    for (int slot = 0; slot < SlotCount; ++slot) {
+        while (T* timer = mSlots[slot]) {
+            refs.push_back(remove(timer));
+        }
+    }
+    // timers are released here, after the wheel is consistent again
+}
+
+template<typename T>
+inline int TimerWheel<T>::findRoot(unsigned int from) const
+{
+    for (unsigned int word = from / 64; word < RootSize / 64; ++word) {
+        uint64_t bits = mOccupied[word];
+        if (word == from / 64)
+            bits &= ~0ULL << (from % 64);
+        if (bits)
+            return word * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+template<typename T>
+inline typename TimerWheel<T>::TimePoint TimerWheel<T>::next() const
+{
+    if (!mCount)
+        return TimePoint::max();
+
+    TimePoint result = TimePoint::max();
+
+    // the first occupied root slot, in tick order. slots before the current index belong to the next rotation
+    const unsigned int index = mCurrent & RootMask;
+    int slot = findRoot(index);
+    if (slot == -1)
+        slot = findRoot(0);
+    if (slot != -1) {
+        for (T* timer = mSlots[slot]; timer; timer = timer->mWheelNext) {
+            if (timer->mNext < result)
+                result = timer->mNext;
+        }
+    }
+
+    // nothing in a higher level slot can be due before that slot cascades
+    int shift = RootBits;
+    for (int level = 1; level <= Levels; ++level, shift += LevelBits) {
+        const uint64_t bits = mOccupied[RootSize / 64 + level - 1];
+        if (!bits)
+            continue;
+        const uint64_t block = mCurrent >> shift;
+        // rotate so that bit 0 is the slot after the current one
+        const unsigned int start = ((block & LevelMask) + 1) & LevelMask;
+        const uint64_t rotated = start ? (bits >> start) | (bits << (64 - start)) : bits;
+        const uint64_t distance = __builtin_ctzll(rotated) + 1;
+        const TimePoint cascade = time((block + distance) << shift);
+        if (cascade < result)
+            result = cascade;
+    }
+    return result;
+}
+
+template<typename T>
+inline void TimerWheel<T>::cascade()
+{
+    // called when mCurrent enters a new rotation of the root wheel, redistribute the
+    // matching slot of each level, going up as long as that level wrapped as well
+    int shift = RootBits;
+    for (int level = 1; level <= Levels; ++level, shift += LevelBits) {
+        const unsigned int index = (mCurrent >> shift) & LevelMask;
+        const int slot = RootSize + (level - 1) * LevelSize + index;
+        mScratch.clear();
+        while (T* timer = mSlots[slot]) {
+            unlink(timer);
+            mScratch.push_back(timer);
+        }
+        for (T* timer : mScratch) {
+            place(timer);
+        }
+        if (index)
+            break;
+    }
+}
+
+template<typename T>
+template<typename Func>
+inline void TimerWheel<T>::expireSlot(unsigned int slot, TimePoint now, bool all, Func& func)
+{
+    T* timer = mSlots[slot];
+    while (timer) {
+        T* next = timer->mWheelNext;
+        if (all || timer->mNext <= now) {
+            func(remove(timer));
+        }
+        timer = next;
+    }
+}
+
+template<typename T>
+template<typename Func>
+inline void TimerWheel<T>::expire(TimePoint now, Func&& func)
+{
+    const uint64_t target = tick(now);
+    if (!mCount) {
+        if (target > mCurrent)
+            mCurrent = target;
+        return;
+    }
+    while (mCurrent < target) {
+        const unsigned int index = mCurrent & RootMask;
+        const uint64_t rotation = mCurrent - index;
+        const int slot = findRoot(index);
+        if (slot != -1 && rotation + slot <= target) {
+            mCurrent = rotation + slot;
+            if (mCurrent == target)
+                break;
+            // every tick before the target is entirely in the past
+            expireSlot(slot, now, true, func);
+            ++mCurrent;
+        } else {
+            mCurrent = rotation + RootSize;
+            if (mCurrent > target) {
+                mCurrent = target;
+                break;
+            }
+        }
+        if (!(mCurrent & RootMask))
+            cascade();
+    }
+    // the current tick is only partially in the past
+    expireSlot(mCurrent & RootMask, now, false, func);
+}
+
+}}} // namespace reckoning::event::detail
+
+#endif // TIMERWHEEL_H
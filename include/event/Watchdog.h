@@ -0,0 +1,77 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <event/Loop.h>
+#include <util/Creatable.h>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace reckoning {
+namespace event {
+
+// Checks on loops from a thread of its own and logs a warning when one has been busy
+// for longer than its threshold without getting back to waiting, naming the event,
+// timer, fd or hook callback that's running. StackSample adds a backtrace of the
+// stuck thread, taken by interrupting it with SampleSignal, where backtrace() is
+// available. the signal cuts sleeps short, other blocking calls carry on. meant for
+// catching blocking calls that have snuck onto a loop thread
+class Watchdog : public util::Creatable<Watchdog>
+{
+public:
+    ~Watchdog();
+
+    void init();
+
+    enum Flag { StackSample = 0x1 };
+
+    // watching a loop again replaces its threshold and flags
+    void watch(const std::shared_ptr<Loop>& loop, std::chrono::milliseconds threshold, uint8_t flags = 0);
+    void unwatch(const std::shared_ptr<Loop>& loop);
+
+    // stops the thread, everything is unwatched
+    void stop();
+
+    // installed the first time a StackSample is taken, the default action for SIGURG is to ignore it
+    static constexpr int SampleSignal = SIGURG;
+
+protected:
+    Watchdog();
+
+private:
+    Watchdog(const Watchdog&) = delete;
+    Watchdog& operator=(const Watchdog&) = delete;
+
+    struct Watched
+    {
+        std::weak_ptr<Loop> loop;
+        const Loop* key;
+        std::chrono::nanoseconds threshold;
+        uint8_t flags;
+        // the awake stamp of the stall we've reported, 0 if none
+        int64_t reported;
+    };
+
+    void run();
+    void check(Watched& watched);
+    std::chrono::nanoseconds interval() const;
+
+    static std::string describe(const Loop::Dispatch& dispatch);
+    static std::vector<std::string> sampleStack(pthread_t thread);
+
+private:
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::vector<Watched> mWatched;
+    bool mStopped;
+};
+
+}} // namespace reckoning::event
+
+#endif // WATCHDOG_H
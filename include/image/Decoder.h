@@ -2,14 +2,12 @@
 #define DECODER_H
 
 #include <buffer/Buffer.h>
+#include <event/Executor.h>
 #include <then/Then.h>
 #include <pool/Pool.h>
 #include <util/Creatable.h>
-#include <condition_variable>
 #include <memory>
-#include <mutex>
 #include <string>
-#include <thread>
 
 namespace reckoning {
 namespace image {
@@ -42,11 +40,7 @@ private:
         then::Then<Image> then;
     };
 
-    std::mutex mMutex;
-    std::condition_variable mCond;
-    std::vector<std::shared_ptr<Job > > mJobs;
-    std::thread mThread;
-    bool mStopped { false };
+    static void run(const std::shared_ptr<Job>& job);
 
 private:
     Decoder(const Decoder&) = delete;
@@ -57,11 +51,9 @@ inline then::Then<Decoder::Image>& Decoder::decode(std::shared_ptr<buffer::Buffe
     auto job = pool::Pool<Job, 10>::pool().get();
     job->data = std::move(buffer);
     job->pitchMultiple = pitchMultiple;
-    {
-        std::unique_lock<std::mutex> locker(mMutex);
-        mJobs.push_back(job);
-        mCond.notify_one();
-    }
+    event::Executor::executor().post([job]() {
+        run(job);
+    });
     return job->then;
 }
 
@@ -3,6 +3,8 @@
 
 #include <buffer/Buffer.h>
 #include <buffer/Pool.h>
+#include <event/Executor.h>
+#include <event/Loop.h>
 #include <then/Then.h>
 #include <pool/Pool.h>
 #include <util/Creatable.h>
@@ -46,10 +48,24 @@ inline then::Then<std::shared_ptr<buffer::Buffer> >& Fetch::fetch(const std::str
     {
         // does this look like a file path?
         if (uri.find("://") == std::string::npos) {
-            // yes, load from file
-            auto buf = buffer::Buffer::fromFile(uri);
-            job->then.resolve(std::move(buf));
-            job->clear();
+            // yes, load from file. reading it can block for a good while so a
+            // loop thread leaves it to the executor
+            std::weak_ptr<event::Loop> loop = event::Loop::loop();
+            if (loop.expired()) {
+                auto buf = buffer::Buffer::fromFile(uri);
+                job->then.resolve(std::move(buf));
+                job->clear();
+            } else {
+                event::Executor::executor().post([job, uri, loop]() {
+                    auto buf = buffer::Buffer::fromFile(uri);
+                    if (auto strong = loop.lock()) {
+                        strong->post([job, buf = std::move(buf)]() mutable {
+                            job->then.resolve(std::move(buf));
+                            job->clear();
+                        });
+                    }
+                });
+            }
         } else {
             // no, http?
             job->http = HttpClient::create(uri);
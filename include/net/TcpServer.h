@@ -17,8 +17,14 @@ namespace net {
 class TcpServer : public std::enable_shared_from_this<TcpServer>, public util::Creatable<TcpServer>
 {
 public:
+    // ReusePort binds with SO_REUSEPORT so that several servers, typically one per
+    // loop in a LoopGroup, can listen on the same port and have the kernel spread
+    // incoming connections between them
+    enum Flag { ReusePort = 0x1 };
+
     ~TcpServer();
 
+    // false with errno set if the socket couldn't be set up, what failed is logged
     bool listen(uint16_t port);
     bool listen(const IPv4& ip, uint16_t port);
     bool listen(const IPv6& ip, uint16_t port);
@@ -31,21 +37,27 @@ public:
     event::Signal<>& onError();
 
 protected:
-    TcpServer();
+    TcpServer(unsigned int flags = 0);
 
 private:
+    bool listen(sockaddr* address, socklen_t len, bool ipv6);
     void socketCallback(int fd, uint8_t flags);
+    void accepted(int fd);
+#if defined(HAVE_IO_URING)
+    void acceptCompleted(int result);
+#endif
 
 private:
     int mFd;
     event::Loop::FD mFdHandle;
     event::Signal<std::shared_ptr<TcpSocket>&&> mConnection;
     event::Signal<> mError;
+    unsigned int mFlags;
     bool mIsIPv6;
 };
 
-inline TcpServer::TcpServer()
-    : mFd(-1), mIsIPv6(false)
+inline TcpServer::TcpServer(unsigned int flags)
+    : mFd(-1), mFlags(flags), mIsIPv6(false)
 {
 }
 
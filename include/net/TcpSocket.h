@@ -7,6 +7,8 @@
 #include <net/IPAddress.h>
 #include <buffer/Buffer.h>
 #include <util/Creatable.h>
+#include <coroutine>
+#include <deque>
 #include <memory>
 #include <string>
 #include <openssl/ssl.h>
@@ -19,7 +21,7 @@ class TcpServer;
 class TcpSocket : public std::enable_shared_from_this<TcpSocket>, public util::Creatable<TcpSocket>
 {
 public:
-    enum { BufferSize = 16384 };
+    enum { BufferSize = 16384, DefaultReadBudgetBytes = 16 * BufferSize, DefaultReadBudgetReads = 64, ReadQueueBuffers = 16 };
     enum Mode { Plain, TLS };
 
     ~TcpSocket();
@@ -49,6 +51,36 @@ public:
     event::Signal<std::shared_ptr<buffer::Buffer>&&>& onData();
     State state() const;
 
+    // co_await read() gives the next chunk of data, or a null buffer once the socket
+    // is closed. from the first call on data is queued while nobody is waiting for it,
+    // up to ReadQueueBuffers chunks. past that the socket stops reading, onData()
+    // included, and leaves the rest to the kernel and the peer until the queue is down
+    // to half
+    class ReadAwaiter
+    {
+    public:
+        ~ReadAwaiter();
+
+        bool await_ready() const;
+        void await_suspend(std::coroutine_handle<> handle);
+        std::shared_ptr<buffer::Buffer> await_resume();
+
+    private:
+        ReadAwaiter(std::shared_ptr<TcpSocket>&& socket) : mSocket(std::move(socket)) { }
+
+        std::shared_ptr<TcpSocket> mSocket;
+        std::coroutine_handle<> mHandle;
+
+        friend class TcpSocket;
+    };
+
+    ReadAwaiter read();
+
+    // the most a single read event is allowed to consume, in bytes and in reads. once
+    // either runs out the socket yields to the rest of the loop and carries on in the
+    // next iteration, so one busy connection can't hold everything else up
+    void setReadBudget(size_t bytes, size_t reads);
+
     static void setCAFile(const std::string& file);
     static void setCAPath(const std::string& path);
 
@@ -58,8 +90,19 @@ protected:
 private:
     void internalConnect(int e, int& fd, event::Loop::FD& handle, int& otherfd, event::Loop::FD& otherHandle);
     void socketCallback(int fd, uint8_t flags);
+    void processRead(int fd);
     void processWrite(int fd);
-    std::shared_ptr<buffer::Buffer> read(size_t bytes = BufferSize);
+    std::shared_ptr<buffer::Buffer> readData(size_t bytes = BufferSize);
+    void wakeReader();
+    void resumeReading();
+#if defined(HAVE_IO_URING)
+    // plain sockets hand their reads and writes to the loop's ring once connected
+    void startRing(int fd);
+    void startRecv(int fd);
+    void recvCompleted(int result, const uint8_t* data);
+    void sendPending(int fd);
+    void sendCompleted(int result);
+#endif
 
     void setSocket(int fd, bool ipv6);
 
@@ -70,12 +113,31 @@ private:
     Mode mMode;
     int mFd4, mFd6;
     size_t mWriteOffset;
+    size_t mReadBudgetBytes, mReadBudgetReads;
     std::vector<std::shared_ptr<buffer::Buffer> > mPendingWrites;
     std::shared_ptr<Resolver::Response> mResolver;
     event::Loop::FD mFd4Handle, mFd6Handle;
     event::Signal<State> mStateChanged;
     event::Signal<std::shared_ptr<buffer::Buffer>&&> mData;
     State mState;
+#if defined(HAVE_IO_URING)
+    // mRingRecv while reads go through the ring, mReceiving while its recv is running.
+    // mSending is what the ring is sending right now, at most one send at a time
+    bool mRingRecv { false }, mRingSend { false }, mReceiving { false };
+    std::shared_ptr<std::vector<std::shared_ptr<buffer::Buffer> > > mSending;
+#endif
+
+    struct Reader
+    {
+        std::deque<std::shared_ptr<buffer::Buffer> > queue;
+        std::coroutine_handle<> waiting;
+        bool done { false };
+        // processRead() stopped because the queue was full
+        bool paused { false };
+        // a resume is posted to the loop
+        bool waking { false };
+    };
+    std::unique_ptr<Reader> mReader;
 
     enum SSLWaitState {
         SSLNotWaiting,
@@ -107,11 +169,48 @@ inline event::Signal<std::shared_ptr<buffer::Buffer>&&>& TcpSocket::onData()
     return mData;
 }
 
+inline void TcpSocket::setReadBudget(size_t bytes, size_t reads)
+{
+    mReadBudgetBytes = bytes;
+    mReadBudgetReads = reads;
+}
+
 inline TcpSocket::State TcpSocket::state() const
 {
     return mState;
 }
 
+inline bool TcpSocket::ReadAwaiter::await_ready() const
+{
+    return !mSocket->mReader->queue.empty() || mSocket->mReader->done;
+}
+
+inline TcpSocket::ReadAwaiter::~ReadAwaiter()
+{
+    // the frame is going away without having been resumed, eg its Task was dropped
+    if (mHandle && mSocket->mReader->waiting == mHandle)
+        mSocket->mReader->waiting = nullptr;
+}
+
+inline void TcpSocket::ReadAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    assert(!mSocket->mReader->waiting && "only one reader at a time");
+    mHandle = handle;
+    mSocket->mReader->waiting = handle;
+}
+
+inline std::shared_ptr<buffer::Buffer> TcpSocket::ReadAwaiter::await_resume()
+{
+    auto& queue = mSocket->mReader->queue;
+    if (queue.empty())
+        return std::shared_ptr<buffer::Buffer>();
+    auto buf = std::move(queue.front());
+    queue.pop_front();
+    if (mSocket->mReader->paused && queue.size() <= ReadQueueBuffers / 2)
+        mSocket->resumeReading();
+    return buf;
+}
+
 inline void TcpSocket::write(const std::shared_ptr<buffer::Buffer>& buffer)
 {
     mPendingWrites.push_back(buffer);
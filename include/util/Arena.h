@@ -0,0 +1,104 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+namespace reckoning {
+namespace util {
+
+// Bump allocator for short lived memory, everything is handed back at once by
+// reset(). freeing the most recent allocation gives its space back right away so
+// that scoped temporaries don't pile up, anything else is only freed by reset().
+// when a chunk runs out the next one is twice as big and the smaller ones are let go
+// of on reset, so after a few rounds one chunk fits it all. not thread safe
+class Arena : public std::pmr::memory_resource
+{
+public:
+    Arena(size_t initial = 16384);
+    ~Arena();
+
+    void reset();
+
+    size_t capacity() const { return mSize; }
+
+protected:
+    virtual void* do_allocate(size_t bytes, size_t alignment) override;
+    virtual void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void grow(size_t bytes);
+
+    unsigned char* mChunk { nullptr };
+    size_t mSize { 0 };
+    size_t mOffset { 0 };
+    // full chunks, freed by reset()
+    std::vector<unsigned char*> mRetired;
+};
+
+inline Arena::Arena(size_t initial)
+{
+    assert(initial > 0);
+    mChunk = static_cast<unsigned char*>(::operator new(initial));
+    mSize = initial;
+}
+
+inline Arena::~Arena()
+{
+    reset();
+    ::operator delete(mChunk);
+}
+
+inline void Arena::reset()
+{
+    for (unsigned char* chunk : mRetired) {
+        ::operator delete(chunk);
+    }
+    mRetired.clear();
+    mOffset = 0;
+}
+
+inline void Arena::grow(size_t bytes)
+{
+    size_t size = mSize * 2;
+    while (size < bytes)
+        size *= 2;
+    mRetired.push_back(mChunk);
+    mChunk = static_cast<unsigned char*>(::operator new(size));
+    mSize = size;
+    mOffset = 0;
+}
+
+inline void* Arena::do_allocate(size_t bytes, size_t alignment)
+{
+    assert(alignment && !(alignment & (alignment - 1)));
+    const uintptr_t base = reinterpret_cast<uintptr_t>(mChunk);
+    size_t offset = ((base + mOffset + alignment - 1) & ~(alignment - 1)) - base;
+    if (offset + bytes > mSize) {
+        // worst case alignment padding included
+        grow(bytes + alignment);
+        const uintptr_t next = reinterpret_cast<uintptr_t>(mChunk);
+        offset = ((next + alignment - 1) & ~(alignment - 1)) - next;
+    }
+    mOffset = offset + bytes;
+    return mChunk + offset;
+}
+
+inline void Arena::do_deallocate(void* ptr, size_t bytes, size_t)
+{
+    unsigned char* p = static_cast<unsigned char*>(ptr);
+    if (p >= mChunk && p + bytes == mChunk + mOffset)
+        mOffset = p - mChunk;
+}
+
+}} // namespace reckoning::util
+
+#endif // ARENA_H
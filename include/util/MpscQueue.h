@@ -0,0 +1,75 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+
+namespace reckoning {
+namespace util {
+
+// Intrusive lock free multi producer, single consumer queue. Producers push onto
+// an atomic list head with a CAS, the consumer takes the entire list in one
+// exchange and reverses it to get the items back in the order they were pushed.
+// Next is the member used to link items, the queue owns the items pushed to it.
+template<typename T, T* T::*Next>
+class MpscQueue
+{
+public:
+    MpscQueue() { }
+    ~MpscQueue();
+
+    // any thread, returns true if the queue was empty
+    bool push(T* item);
+
+    // returns all queued items in fifo order, linked through Next. it swaps out the
+    // whole list in one go so several consumers can share a queue, each gets items
+    // of its own
+    T* take();
+
+    bool empty() const { return mHead.load() == nullptr; }
+
+private:
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    std::atomic<T*> mHead { nullptr };
+};
+
+template<typename T, T* T::*Next>
+inline MpscQueue<T, Next>::~MpscQueue()
+{
+    T* item = take();
+    while (item) {
+        T* next = item->*Next;
+        delete item;
+        item = next;
+    }
+}
+
+template<typename T, T* T::*Next>
+inline bool MpscQueue<T, Next>::push(T* item)
+{
+    T* head = mHead.load(std::memory_order_relaxed);
+    do {
+        item->*Next = head;
+    } while (!mHead.compare_exchange_weak(head, item));
+    return head == nullptr;
+}
+
+template<typename T, T* T::*Next>
+inline T* MpscQueue<T, Next>::take()
+{
+    T* item = mHead.exchange(nullptr, std::memory_order_acquire);
+    // reverse
+    T* prev = nullptr;
+    while (item) {
+        T* next = item->*Next;
+        item->*Next = prev;
+        prev = item;
+        item = next;
+    }
+    return prev;
+}
+
+}} // namespace reckoning::util
+
+#endif // MPSCQUEUE_H
@@ -0,0 +1,126 @@
+#ifndef SIZECLASSALLOCATOR_H
+#define SIZECLASSALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+
+namespace reckoning {
+namespace util {
+
+// Per thread free lists, one per 64 byte size class from 64 bytes up to and including
+// 1k. Blocks can be freed on a different thread than the one that allocated them, they
+// simply end up in the freeing thread's lists. Each list keeps at most MaxFree blocks
+// around. once a thread's allocator has been destroyed at thread exit, whatever that
+// thread still allocates or frees goes straight to operator new and delete
+class SizeClassAllocator
+{
+public:
+    // class n holds blocks of n * Granularity bytes, class 0 only ever sees size 0
+    enum { Granularity = 64, Classes = 17, MaxFree = 64 };
+
+    ~SizeClassAllocator();
+
+    void* allocate(size_t size);
+    void deallocate(void* ptr);
+
+    static SizeClassAllocator& allocator();
+
+private:
+    struct Block
+    {
+        union {
+            Block* next;
+            size_t sizeClass;
+        };
+        // keep the allocation itself suitably aligned
+        alignas(std::max_align_t) unsigned char data[1];
+    };
+
+    static constexpr size_t HeaderSize = offsetof(Block, data);
+
+    Block* mFree[Classes] {};
+    size_t mFreeCount[Classes] {};
+    // set by the destructor, thread_locals destroyed after us can still free into us
+    bool mDestroyed { false };
+};
+
+inline SizeClassAllocator::~SizeClassAllocator()
+{
+    mDestroyed = true;
+    for (size_t i = 0; i < Classes; ++i) {
+        Block* block = mFree[i];
+        while (block) {
+            Block* next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
+        mFree[i] = nullptr;
+        mFreeCount[i] = 0;
+    }
+}
+
+inline void* SizeClassAllocator::allocate(size_t size)
+{
+    if (mDestroyed) {
+        // marked as oversized so that it's never cached, whichever thread frees it
+        Block* block = static_cast<Block*>(::operator new(HeaderSize + size));
+        block->sizeClass = Classes;
+        return block->data;
+    }
+    const size_t sizeClass = (size + Granularity - 1) / Granularity;
+    Block* block;
+    if (sizeClass < Classes && mFree[sizeClass]) {
+        block = mFree[sizeClass];
+        mFree[sizeClass] = block->next;
+        --mFreeCount[sizeClass];
+    } else {
+        // oversized blocks get the exact size and are never cached
+        const size_t bytes = sizeClass < Classes ? sizeClass * Granularity : size;
+        block = static_cast<Block*>(::operator new(HeaderSize + bytes));
+    }
+    block->sizeClass = sizeClass;
+    return block->data;
+}
+
+inline void SizeClassAllocator::deallocate(void* ptr)
+{
+    Block* block = reinterpret_cast<Block*>(static_cast<unsigned char*>(ptr) - HeaderSize);
+    const size_t sizeClass = block->sizeClass;
+    if (mDestroyed || sizeClass >= Classes || mFreeCount[sizeClass] >= MaxFree) {
+        ::operator delete(block);
+        return;
+    }
+    block->next = mFree[sizeClass];
+    mFree[sizeClass] = block;
+    ++mFreeCount[sizeClass];
+}
+
+inline SizeClassAllocator& SizeClassAllocator::allocator()
+{
+    thread_local static SizeClassAllocator tAllocator;
+    return tAllocator;
+}
+
+// std allocator on top of SizeClassAllocator, for std::allocate_shared and friends
+template<typename T>
+class SizeClassStdAllocator
+{
+public:
+    using value_type = T;
+
+    SizeClassStdAllocator() { }
+    template<typename U>
+    SizeClassStdAllocator(const SizeClassStdAllocator<U>&) { }
+
+    T* allocate(size_t n) { return static_cast<T*>(SizeClassAllocator::allocator().allocate(n * sizeof(T))); }
+    void deallocate(T* ptr, size_t) { SizeClassAllocator::allocator().deallocate(ptr); }
+
+    template<typename U>
+    bool operator==(const SizeClassStdAllocator<U>&) const { return true; }
+    template<typename U>
+    bool operator!=(const SizeClassStdAllocator<U>&) const { return false; }
+};
+
+}} // namespace reckoning::util
+
+#endif // SIZECLASSALLOCATOR_H
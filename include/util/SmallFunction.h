@@ -0,0 +1,158 @@
+#ifndef SMALLFUNCTION_H
+#define SMALLFUNCTION_H
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+namespace reckoning {
+namespace util {
+
+// Move only replacement for std::function. Callables of up to Size bytes that can
+// be moved without throwing are stored inline, anything else goes on the heap.
+template<typename Signature, size_t Size = 64>
+class SmallFunction;
+
+template<typename R, typename ...Args, size_t Size>
+class SmallFunction<R(Args...), Size>
+{
+public:
+    SmallFunction() { }
+    SmallFunction(std::nullptr_t) { }
+    template<typename F,
+             typename std::enable_if<!std::is_same<typename std::decay<F>::type, SmallFunction>::value
+                                     && std::is_invocable_r<R, typename std::decay<F>::type&, Args...>::value, int>::type = 0>
+    SmallFunction(F&& func)
+    {
+        using Func = typename std::decay<F>::type;
+        if constexpr (isInline<Func>) {
+            new (mStorage) Func(std::forward<F>(func));
+            mOps = &InlineOps<Func>::ops;
+        } else {
+            *reinterpret_cast<Func**>(mStorage) = new Func(std::forward<F>(func));
+            mOps = &HeapOps<Func>::ops;
+        }
+    }
+    SmallFunction(SmallFunction&& other);
+    ~SmallFunction();
+
+    SmallFunction& operator=(SmallFunction&& other);
+    SmallFunction& operator=(std::nullptr_t);
+
+    explicit operator bool() const { return mOps != nullptr; }
+
+    R operator()(Args... args);
+
+    // like std::function::target_type, typeid(void) when empty
+    const std::type_info& target_type() const { return mOps ? mOps->type() : typeid(void); }
+
+    template<typename F>
+    static constexpr bool isInline = sizeof(F) <= Size
+        && alignof(F) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible<F>::value;
+
+private:
+    SmallFunction(const SmallFunction&) = delete;
+    SmallFunction& operator=(const SmallFunction&) = delete;
+
+    struct Ops
+    {
+        R (*invoke)(void* storage, Args&& ...args);
+        // move constructs into dst and destroys src
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+        const std::type_info& (*type)();
+    };
+
+    template<typename F>
+    struct InlineOps
+    {
+        static R invoke(void* storage, Args&& ...args) { return (*static_cast<F*>(storage))(std::forward<Args>(args)...); }
+        static void move(void* dst, void* src)
+        {
+            new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void destroy(void* storage) { static_cast<F*>(storage)->~F(); }
+        static const std::type_info& type() { return typeid(F); }
+
+        static constexpr Ops ops { &invoke, &move, &destroy, &type };
+    };
+
+    template<typename F>
+    struct HeapOps
+    {
+        static R invoke(void* storage, Args&& ...args) { return (**static_cast<F**>(storage))(std::forward<Args>(args)...); }
+        static void move(void* dst, void* src) { *static_cast<F**>(dst) = *static_cast<F**>(src); }
+        static void destroy(void* storage) { delete *static_cast<F**>(storage); }
+        static const std::type_info& type() { return typeid(F); }
+
+        static constexpr Ops ops { &invoke, &move, &destroy, &type };
+    };
+
+    void reset();
+
+private:
+    alignas(std::max_align_t) unsigned char mStorage[Size];
+    const Ops* mOps { nullptr };
+};
+
+template<typename R, typename ...Args, size_t Size>
+inline SmallFunction<R(Args...), Size>::SmallFunction(SmallFunction&& other)
+    : mOps(other.mOps)
+{
+    if (mOps) {
+        mOps->move(mStorage, other.mStorage);
+        other.mOps = nullptr;
+    }
+}
+
+template<typename R, typename ...Args, size_t Size>
+inline SmallFunction<R(Args...), Size>::~SmallFunction()
+{
+    reset();
+}
+
+template<typename R, typename ...Args, size_t Size>
+inline void SmallFunction<R(Args...), Size>::reset()
+{
+    if (mOps) {
+        mOps->destroy(mStorage);
+        mOps = nullptr;
+    }
+}
+
+template<typename R, typename ...Args, size_t Size>
+inline SmallFunction<R(Args...), Size>& SmallFunction<R(Args...), Size>::operator=(SmallFunction&& other)
+{
+    if (this != &other) {
+        reset();
+        mOps = other.mOps;
+        if (mOps) {
+            mOps->move(mStorage, other.mStorage);
+            other.mOps = nullptr;
+        }
+    }
+    return *this;
+}
+
+template<typename R, typename ...Args, size_t Size>
+inline SmallFunction<R(Args...), Size>& SmallFunction<R(Args...), Size>::operator=(std::nullptr_t)
+{
+    reset();
+    return *this;
+}
+
+template<typename R, typename ...Args, size_t Size>
+inline R SmallFunction<R(Args...), Size>::operator()(Args... args)
+{
+    assert(mOps);
+    return mOps->invoke(mStorage, std::forward<Args>(args)...);
+}
+
+}} // namespace reckoning::util
+
+#endif // SMALLFUNCTION_H
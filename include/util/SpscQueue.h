@@ -0,0 +1,115 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace reckoning {
+namespace util {
+
+// Bounded lock free single producer, single consumer ring, the capacity is rounded up
+// to a power of two. Each side owns one index on a cache line of its own and keeps a
+// copy of the other side's index, the shared one is only read when the copy says the
+// ring is full or empty.
+template<typename T>
+class SpscQueue
+{
+public:
+    SpscQueue(size_t capacity);
+    ~SpscQueue();
+
+    size_t capacity() const { return mMask + 1; }
+
+    // producer only, returns false and leaves value alone if the ring is full
+    template<typename U>
+    bool push(U&& value);
+
+    // consumer only, calls func(T&&) for up to max values and returns how many. the
+    // slots are handed back to the producer in one go once they're all done
+    template<typename F>
+    size_t drain(F&& func, size_t max);
+
+    bool empty() const { return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_acquire); }
+
+private:
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    enum { CacheLine = 64 };
+
+    T* mSlots;
+    size_t mMask;
+
+    // producer side
+    alignas(CacheLine) std::atomic<size_t> mTail { 0 };
+    size_t mCachedHead { 0 };
+
+    // consumer side
+    alignas(CacheLine) std::atomic<size_t> mHead { 0 };
+    size_t mCachedTail { 0 };
+};
+
+template<typename T>
+inline SpscQueue<T>::SpscQueue(size_t capacity)
+{
+    assert(capacity > 0);
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    mMask = size - 1;
+    mSlots = std::allocator<T>().allocate(size);
+}
+
+template<typename T>
+inline SpscQueue<T>::~SpscQueue()
+{
+    const size_t tail = mTail.load(std::memory_order_acquire);
+    for (size_t head = mHead.load(std::memory_order_relaxed); head != tail; ++head) {
+        mSlots[head & mMask].~T();
+    }
+    std::allocator<T>().deallocate(mSlots, mMask + 1);
+}
+
+template<typename T>
+template<typename U>
+inline bool SpscQueue<T>::push(U&& value)
+{
+    const size_t tail = mTail.load(std::memory_order_relaxed);
+    if (tail - mCachedHead > mMask) {
+        mCachedHead = mHead.load(std::memory_order_acquire);
+        if (tail - mCachedHead > mMask)
+            return false;
+    }
+    new (&mSlots[tail & mMask]) T(std::forward<U>(value));
+    mTail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+template<typename F>
+inline size_t SpscQueue<T>::drain(F&& func, size_t max)
+{
+    const size_t head = mHead.load(std::memory_order_relaxed);
+    if (head == mCachedTail) {
+        mCachedTail = mTail.load(std::memory_order_acquire);
+        if (head == mCachedTail)
+            return 0;
+    }
+    const size_t count = std::min(mCachedTail - head, max);
+    for (size_t i = 0; i < count; ++i) {
+        T& slot = mSlots[(head + i) & mMask];
+        func(std::move(slot));
+        slot.~T();
+    }
+    mHead.store(head + count, std::memory_order_release);
+    return count;
+}
+
+}} // namespace reckoning::util
+
+#endif // SPSCQUEUE_H
@@ -0,0 +1,36 @@
+#ifndef THREADUTIL_H
+#define THREADUTIL_H
+
+#include <string>
+#include <vector>
+
+namespace reckoning {
+namespace util {
+namespace thread {
+
+// These all work on the calling thread and return false where the platform doesn't
+// support them or the call failed, with errno set in the latter case.
+
+// shows up in top, perf and gdb. Linux cuts it off at 15 characters
+bool setName(const std::string& name);
+
+// restricts the thread to the given cpus
+bool setAffinity(const std::vector<unsigned int>& cpus);
+
+// the cpus the thread is allowed to run on, as inherited from its parent or set by
+// taskset and cgroup cpusets. empty where that can't be found out
+std::vector<unsigned int> affinity();
+
+// the memory node the thread is running on right now, -1 if unknown. after
+// setAffinity() that's a node of the new cpus
+int numaNode();
+
+// memory the thread touches first comes from node where possible, no matter which
+// cpu the thread moves to or what policy the process was started with (numactl
+// --interleave and the like). anything allocated on the thread afterwards, its
+// thread local pools included, lands there
+bool setMemoryNode(int node);
+
+}}} // namespace reckoning::util::thread
+
+#endif // THREADUTIL_H
@@ -0,0 +1,143 @@
+#ifndef WORKSTEALINGDEQUE_H
+#define WORKSTEALINGDEQUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace reckoning {
+namespace util {
+
+// Chase-Lev deque of pointers. The owner pushes and takes at the bottom without any
+// locking, other threads steal from the top with a CAS that only contends when the
+// deque is down to its last item. The ring doubles when full, the old ones are kept
+// around until the deque goes away since a thief might still be reading from one.
+// The deque doesn't own what's in it.
+template<typename T>
+class WorkStealingDeque
+{
+public:
+    WorkStealingDeque(size_t capacity = 256);
+
+    // owner only
+    void push(T* item);
+    // owner only, newest first. nullptr when empty
+    T* take();
+
+    // any thread, oldest first. nullptr when empty or when another thread got there first
+    T* steal();
+
+    bool empty() const;
+
+private:
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    enum { CacheLine = 64 };
+
+    struct Ring
+    {
+        Ring(size_t size) : mask(size - 1), slots(new std::atomic<T*>[size]) { }
+
+        T* get(int64_t index) const { return slots[index & mask].load(std::memory_order_relaxed); }
+        void put(int64_t index, T* item) { slots[index & mask].store(item, std::memory_order_relaxed); }
+
+        const size_t mask;
+        std::unique_ptr<std::atomic<T*>[]> slots;
+    };
+
+    Ring* grow(Ring* ring, int64_t top, int64_t bottom);
+
+    alignas(CacheLine) std::atomic<int64_t> mTop { 0 };
+    alignas(CacheLine) std::atomic<int64_t> mBottom { 0 };
+    std::atomic<Ring*> mRing;
+    // every ring we've had, owner only
+    std::vector<std::unique_ptr<Ring> > mRings;
+};
+
+template<typename T>
+inline WorkStealingDeque<T>::WorkStealingDeque(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    mRings.push_back(std::make_unique<Ring>(size));
+    mRing.store(mRings.back().get(), std::memory_order_relaxed);
+}
+
+template<typename T>
+inline typename WorkStealingDeque<T>::Ring* WorkStealingDeque<T>::grow(Ring* ring, int64_t top, int64_t bottom)
+{
+    auto bigger = std::make_unique<Ring>((ring->mask + 1) * 2);
+    for (int64_t i = top; i < bottom; ++i) {
+        bigger->put(i, ring->get(i));
+    }
+    Ring* next = bigger.get();
+    mRings.push_back(std::move(bigger));
+    mRing.store(next, std::memory_order_release);
+    return next;
+}
+
+template<typename T>
+inline void WorkStealingDeque<T>::push(T* item)
+{
+    const int64_t bottom = mBottom.load(std::memory_order_relaxed);
+    const int64_t top = mTop.load(std::memory_order_acquire);
+    Ring* ring = mRing.load(std::memory_order_relaxed);
+    if (bottom - top > static_cast<int64_t>(ring->mask))
+        ring = grow(ring, top, bottom);
+    ring->put(bottom, item);
+    // pairs with the acquire of bottom in steal(), the item has to be visible before the index
+    mBottom.store(bottom + 1, std::memory_order_release);
+}
+
+template<typename T>
+inline T* WorkStealingDeque<T>::take()
+{
+    const int64_t bottom = mBottom.load(std::memory_order_relaxed) - 1;
+    Ring* ring = mRing.load(std::memory_order_relaxed);
+    mBottom.store(bottom, std::memory_order_relaxed);
+    // thieves have to see the smaller bottom before we look at top
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = mTop.load(std::memory_order_relaxed);
+    if (top > bottom) {
+        // empty
+        mBottom.store(bottom + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    T* item = ring->get(bottom);
+    if (top == bottom) {
+        // the last one, race the thieves for it
+        if (!mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            item = nullptr;
+        mBottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return item;
+}
+
+template<typename T>
+inline T* WorkStealingDeque<T>::steal()
+{
+    int64_t top = mTop.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t bottom = mBottom.load(std::memory_order_acquire);
+    if (top >= bottom)
+        return nullptr;
+    Ring* ring = mRing.load(std::memory_order_acquire);
+    T* item = ring->get(top);
+    if (!mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return nullptr;
+    return item;
+}
+
+template<typename T>
+inline bool WorkStealingDeque<T>::empty() const
+{
+    return mTop.load(std::memory_order_acquire) >= mBottom.load(std::memory_order_acquire);
+}
+
+}} // namespace reckoning::util
+
+#endif // WORKSTEALINGDEQUE_H
@@ -0,0 +1,186 @@
+#include <event/Executor.h>
+#include <log/Log.h>
+#include <util/Thread.h>
+#include <algorithm>
+
+using namespace reckoning;
+using namespace reckoning::event;
+using namespace reckoning::log;
+
+std::atomic<size_t> Executor::sDefaultSize(0);
+std::mutex Executor::sDefaultCpusMutex;
+std::vector<unsigned int> Executor::sDefaultCpus;
+
+// the executor and worker the current thread belongs to, if any
+thread_local static Executor* tExecutor = nullptr;
+thread_local static size_t tWorker = 0;
+
+Executor::Executor(size_t threads, std::vector<unsigned int> cpus)
+    : mCpus(std::move(cpus)), mSleepers(0), mNextWake(0), mStopped(false)
+{
+    if (!threads)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    mWorkers.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        mWorkers.push_back(std::make_unique<Worker>());
+    }
+    mThreads.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        mThreads.push_back(std::thread(&Executor::run, this, i));
+    }
+}
+
+Executor::~Executor()
+{
+    shutdown();
+}
+
+Executor& Executor::executor()
+{
+    static Executor sExecutor(sDefaultSize.load(), []() {
+        std::lock_guard<std::mutex> locker(sDefaultCpusMutex);
+        return sDefaultCpus;
+    }());
+    return sExecutor;
+}
+
+void Executor::setDefaultSize(size_t threads)
+{
+    sDefaultSize.store(threads);
+}
+
+void Executor::setDefaultCpus(std::vector<unsigned int> cpus)
+{
+    std::lock_guard<std::mutex> locker(sDefaultCpusMutex);
+    sDefaultCpus = std::move(cpus);
+}
+
+void Executor::post(Task&& task)
+{
+    Item* item = new Item(std::move(task));
+    if (tExecutor == this) {
+        mWorkers[tWorker]->deque.push(item);
+    } else {
+        mInjected.push(item);
+    }
+    // pairs with the fence in run(), either we see a sleeper or it sees the item
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mSleepers.load(std::memory_order_relaxed))
+        wakeOne();
+}
+
+void Executor::wakeOne()
+{
+    const size_t count = mWorkers.size();
+    const size_t start = mNextWake.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        Worker& worker = *mWorkers[(start + i) % count];
+        uint32_t state = Sleeping;
+        if (worker.state.compare_exchange_strong(state, Notified)) {
+            mSleepers.fetch_sub(1);
+            worker.state.notify_one();
+            return;
+        }
+    }
+}
+
+Executor::Item* Executor::find(size_t index)
+{
+    // newest first from our own deque
+    Worker& own = *mWorkers[index];
+    if (Item* item = own.deque.take())
+        return item;
+    // then whatever was posted from outside, the rest of it goes in our deque where
+    // the others can steal it
+    if (Item* item = mInjected.take()) {
+        for (Item* rest = item->next; rest; ) {
+            Item* next = rest->next;
+            own.deque.push(rest);
+            rest = next;
+        }
+        if (item->next)
+            wakeOne();
+        return item;
+    }
+    // oldest first from everyone else's
+    const size_t count = mWorkers.size();
+    for (size_t i = 1; i < count; ++i) {
+        if (Item* item = mWorkers[(index + i) % count]->deque.steal())
+            return item;
+    }
+    return nullptr;
+}
+
+bool Executor::hasWork() const
+{
+    if (!mInjected.empty())
+        return true;
+    for (const auto& worker : mWorkers) {
+        if (!worker->deque.empty())
+            return true;
+    }
+    return false;
+}
+
+void Executor::run(size_t index)
+{
+    tExecutor = this;
+    tWorker = index;
+
+    util::thread::setName("worker" + std::to_string(index));
+    if (!mCpus.empty() && !util::thread::setAffinity(mCpus)) {
+        Log(Log::Warn) << "unable to pin worker" << index << "to its cpu set" << errno;
+    }
+
+    Worker& worker = *mWorkers[index];
+    while (!mStopped.load()) {
+        if (Item* item = find(index)) {
+            item->task();
+            delete item;
+            continue;
+        }
+
+        // park, but look once more after saying so. a post that came in before it
+        // could see us sleeping is picked up here, any later one wakes us
+        worker.state.store(Sleeping);
+        mSleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (hasWork() || mStopped.load()) {
+            uint32_t state = Sleeping;
+            if (worker.state.compare_exchange_strong(state, Running))
+                mSleepers.fetch_sub(1);
+            // otherwise a post beat us to it and already took us off the count
+            worker.state.store(Running);
+            continue;
+        }
+        while (worker.state.load() == Sleeping) {
+            worker.state.wait(Sleeping);
+        }
+        worker.state.store(Running);
+    }
+}
+
+void Executor::shutdown()
+{
+    mStopped.store(true);
+    for (auto& worker : mWorkers) {
+        worker->state.store(Notified);
+        worker->state.notify_one();
+    }
+    for (auto& thread : mThreads) {
+        if (thread.joinable())
+            thread.join();
+    }
+    mThreads.clear();
+    // drop what never got started
+    for (auto& worker : mWorkers) {
+        while (Item* item = worker->deque.take()) {
+            delete item;
+        }
+    }
+    for (Item* item = mInjected.take(); item; ) {
+        Item* next = item->next;
+        delete item;
+        item = next;
+    }
+}
@@ -1,19 +1,93 @@
 #include <event/Loop.h>
 #include <util/Socket.h>
 #include <log/Log.h>
+#include <net/Resolver.h>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_BUSY_POLL
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SIGNALFD
+#include <sys/signalfd.h>
+#endif
 
 using namespace reckoning;
 using namespace reckoning::event;
 using namespace reckoning::log;
 
 thread_local std::weak_ptr<Loop> Loop::tLoop;
+thread_local util::Arena* Loop::tArena = nullptr;
+std::atomic<int> Loop::sLoops(0);
+
+#ifndef HAVE_SIGNALFD
+// write end of the pipe of the loop handling each signal, plus one so that 0 means none
+static std::atomic<int> sSignalPipes[NSIG];
+
+static void signalHandler(int signo)
+{
+    const int fd = sSignalPipes[signo].load() - 1;
+    if (fd < 0)
+        return;
+    const int saved = errno;
+    const unsigned char c = static_cast<unsigned char>(signo);
+    int e;
+    eintrwrap(e, write(fd, &c, 1));
+    errno = saved;
+}
+#endif
 
-Loop::Loop()
-    : mStopped(false), mStatus(0)
+// the events of one batch, chained through mNextEvent in the order they were sent
+class Loop::BatchEvent : public Loop::Event
 {
+public:
+    BatchEvent(Event* head) : mHead(head) { }
+    virtual ~BatchEvent() override
+    {
+        while (mHead) {
+            Event* next = mHead->mNextEvent;
+            delete mHead;
+            mHead = next;
+        }
+    }
+
+    static void* operator new(size_t size) { return util::SizeClassAllocator::allocator().allocate(size); }
+    static void operator delete(void* ptr) { util::SizeClassAllocator::allocator().deallocate(ptr); }
+
+protected:
+    virtual void execute() override
+    {
+        while (mHead) {
+            std::unique_ptr<Event> event(mHead);
+            mHead = mHead->mNextEvent;
+            event->execute();
+        }
+    }
+
+private:
+    Event* mHead;
+};
+
+Loop::Loop(ClockMode clock)
+    : mWaitState(Running), mClockMode(clock), mStopped(false), mStatus(0)
+{
+    mVirtualNow.store(steadyNanoseconds());
+#if defined(HAVE_IO_URING)
+    mRing = nullptr;
+#endif
+#if defined(HAVE_EPOLL) && defined(HAVE_TIMERFD)
+    mTimerFd = -1;
+#endif
     mThread = std::this_thread::get_id();
+    mPthread = pthread_self();
+    mSignalFd[0] = mSignalFd[1] = -1;
+#ifdef HAVE_SIGNALFD
+    sigemptyset(&mSignalMask);
+#endif
+    sLoops.fetch_add(1);
     //send([](int, const char*) -> void { }, 10, "123");
 }
 
@@ -24,14 +98,25 @@ Loop::~Loop()
 
 void Loop::commonInit()
 {
+    tArena = &mArena;
     mWakeup[0] = mWakeup[1] = -1;
+#ifdef HAVE_EVENTFD
+    // one fd serves as both ends
+    mWakeup[0] = mWakeup[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mWakeup[0] == -1) {
+        Log(Log::Error) << "unable to make wakeup eventfd for eventloop" << errno;
+        cleanup();
+        return;
+    }
+#else
     int e = pipe(mWakeup);
     if (e == -1) {
         Log(Log::Error) << "unable to make wakeup pope for eventloop" << errno;
         cleanup();
         return;
     }
-#ifdef HAVE_NONBLOCK
+#endif
+#if defined(HAVE_NONBLOCK) && !defined(HAVE_EVENTFD)
     if (!util::socket::setFlag(mWakeup[0], O_NONBLOCK)) {
         Log(Log::Error) << "unable to set nonblock for wakeup pipe" << errno;
         cleanup();
@@ -42,17 +127,50 @@ void Loop::commonInit()
 
 void Loop::destroy()
 {
+    // whatever didn't fit in the last bulk slice, the queues clean up after themselves
+    while (mBulkEvents) {
+        std::unique_ptr<Event> e(mBulkEvents);
+        mBulkEvents = mBulkEvents->mNextEvent;
+    }
+    reapFds();
+    closeSignals();
+    flushBatches();
     deinit();
     cleanup();
+
+    // the resolver is shared between all loops
+    if (sLoops.fetch_sub(1) == 1) {
+        net::Resolver::resolver().shutdown();
+    }
 }
 
 void Loop::wakeup(bool forceWrite)
 {
-    if (!forceWrite && mThread == std::this_thread::get_id())
-        return;
+    if (!forceWrite) {
+        if (mThread == std::this_thread::get_id())
+            return;
+        // if the loop is running it'll see our change before it waits again,
+        // if it's waiting then only the first one to get here needs to write
+        if (mWaitState.load() != Polling)
+            return;
+        int state = Polling;
+        if (!mWaitState.compare_exchange_strong(state, Signaled))
+            return;
+    }
+    int e;
+    // good for both an eventfd and a pipe
+    const uint64_t c = 1;
+    eintrwrap(e, write(mWakeup[1], &c, sizeof(c)));
+}
+
+void Loop::readWakeup()
+{
+    // read and discard
     int e;
-    const int c = 'w';
-    eintrwrap(e, write(mWakeup[1], &c, 1));
+    char buf[64];
+    do {
+        eintrwrap(e, read(mWakeup[0], buf, sizeof(buf)));
+    } while (e == sizeof(buf));
 }
 
 void Loop::cleanup()
@@ -62,14 +180,14 @@ void Loop::cleanup()
         eintrwrap(e, close(mFd));
         mFd = -1;
     }
+    if (mWakeup[1] != -1 && mWakeup[1] != mWakeup[0]) {
+        eintrwrap(e, close(mWakeup[1]));
+    }
+    mWakeup[1] = -1;
     if (mWakeup[0] != -1) {
         eintrwrap(e, close(mWakeup[0]));
         mWakeup[0] = -1;
     }
-    if (mWakeup[1] != -1) {
-        eintrwrap(e, close(mWakeup[1]));
-        mWakeup[1] = -1;
-    }
 }
 
 void Loop::exit(int status)
@@ -79,3 +197,830 @@ void Loop::exit(int status)
     mStatus = status;
     wakeup(true);
 }
+
+bool Loop::processEvents()
+{
+    size_t bulk = 0;
+    for (;;) {
+        // are we stopped?
+        if (mStopped.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        // urgent ones first, all of them, and again after every bulk event
+        if (!mUrgentEvents.empty()) {
+            Event* event = mUrgentEvents.take();
+            while (event) {
+                std::unique_ptr<Event> e(event);
+                event = event->mNextEvent;
+                beginDispatch(e.get());
+                e->execute();
+                endDispatch();
+            }
+            continue;
+        }
+
+        if (bulk == mBulkSlice)
+            break;
+        if (!mBulkEvents) {
+            mBulkEvents = mEvents.take();
+            if (!mBulkEvents)
+                break;
+        }
+        std::unique_ptr<Event> e(mBulkEvents);
+        mBulkEvents = mBulkEvents->mNextEvent;
+        beginDispatch(e.get());
+        e->execute();
+        endDispatch();
+        ++bulk;
+    }
+    // did one of the events stop us?
+    return !mStopped.load(std::memory_order_acquire);
+}
+
+bool Loop::hasEvents() const
+{
+    return mBulkEvents || !mEvents.empty() || !mUrgentEvents.empty();
+}
+
+Loop::FD Loop::addFdCallback(int fd, uint8_t flags, std::unique_ptr<FdCallback>&& callback)
+{
+    assert(!(flags & FdError));
+
+    FD r;
+    r.mFd = fd;
+    r.mLoop = shared_from_this();
+
+    if (isLoopThread()) {
+        applyAddFd(fd, flags, std::move(callback));
+    } else {
+        post([this, fd, flags, callback = std::move(callback)]() mutable {
+            applyAddFd(fd, flags, std::move(callback));
+        });
+    }
+
+    return r;
+}
+
+void Loop::applyAddFd(int fd, uint8_t flags, std::unique_ptr<FdCallback>&& callback)
+{
+    assert(isLoopThread());
+
+    FdEntry& entry = fdEntry(fd);
+    // the old callback might be the one that's currently running
+    if (entry.callback)
+        mDeadFdCallbacks.push_back(std::move(entry.callback));
+    entry.callback = std::move(callback);
+    entry.flags = flags & (FdRead | FdWrite);
+    entry.edgeWrite = (flags & FdEdgeWrite) != 0;
+
+    // this cancels a pending close, in case someone removes and readds in the same iteration
+    auto closing = std::find(mClosingFds.begin(), mClosingFds.end(), fd);
+    if (closing != mClosingFds.end())
+        mClosingFds.erase(closing);
+
+    const uint8_t interest = entry.interest();
+    if (!entry.registered) {
+        if (mBusyPollFlags & BusyPollSockets)
+            applyBusyPollSocket(fd);
+        registerFd(fd, interest);
+        entry.registered = true;
+        entry.applied = interest;
+    } else if (entry.applied != interest) {
+        modifyFd(fd, interest);
+        entry.applied = interest;
+    }
+}
+
+void Loop::applyUpdateFd(int fd, uint8_t flags)
+{
+    assert(isLoopThread());
+
+    FdEntry& entry = fdEntry(fd);
+    if (entry.flags == flags)
+        return;
+    entry.flags = flags;
+    // with FdEdgeWrite flipping FdWrite doesn't change what the backend watches, except
+    // on io_uring
+    const uint8_t interest = entry.interest();
+    if (!entry.registered || entry.applied == interest)
+        return;
+    modifyFd(fd, interest);
+    entry.applied = interest;
+}
+
+void Loop::applyRemoveFd(int fd)
+{
+    assert(isLoopThread());
+
+    FdEntry& entry = fdEntry(fd);
+    if (entry.callback)
+        mDeadFdCallbacks.push_back(std::move(entry.callback));
+    entry.flags = 0;
+    entry.edgeWrite = false;
+    // an fd that errored out is already queued up to be closed
+    if (!entry.registered)
+        return;
+    unregisterFd(fd);
+    entry.registered = false;
+    entry.applied = 0;
+    // a pending retry would go to whoever gets this fd number next
+    mRetryFds.erase(std::remove_if(mRetryFds.begin(), mRetryFds.end(), [fd](const std::pair<int, uint8_t>& retry) {
+        return retry.first == fd;
+    }), mRetryFds.end());
+    // events for this fd might still be queued up in the current poll batch, keep the
+    // fd number from being reused until we're done dispatching
+    mClosingFds.push_back(fd);
+}
+
+void Loop::applyBusyPollSocket(int fd)
+{
+#ifdef HAVE_BUSY_POLL
+    // not every fd is a socket, and raising it past net.core.busy_read needs
+    // CAP_NET_ADMIN. neither is worth complaining about
+    const int usecs = (mBusyPollFlags & BusyPollSockets)
+        ? std::chrono::duration_cast<std::chrono::microseconds>(mBusyPollBudget).count() : 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (void*)&usecs, sizeof(int));
+#else
+    (void)fd;
+#endif
+}
+
+void Loop::setBusyPoll(std::chrono::microseconds budget, uint8_t flags)
+{
+    send([this, budget, flags]() {
+        const bool sockets = (flags & BusyPollSockets) || (mBusyPollFlags & BusyPollSockets);
+        mBusyPollBudget = budget;
+        mBusyPollFlags = flags;
+        if (!sockets)
+            return;
+        // update or reset the fds we already have
+        for (size_t fd = 0; fd < mFdTable.size(); ++fd) {
+            if (mFdTable[fd].registered)
+                applyBusyPollSocket(fd);
+        }
+    });
+}
+
+bool Loop::busyPoll(std::chrono::nanoseconds limit)
+{
+    // other threads still think we're running at this point so they just queue
+    // their events without writing to the wakeup fd, we have to look for ourselves
+    const auto start = std::chrono::steady_clock::now();
+    auto deadline = start + limit;
+    std::chrono::time_point<std::chrono::steady_clock> now;
+    const uint64_t dispatches = mFdDispatches;
+    bool found = false;
+    for (;;) {
+        const int polled = poll(std::chrono::nanoseconds{0});
+        now = std::chrono::steady_clock::now();
+        if (polled < 0) {
+            // let the blocking poll deal with it
+            break;
+        }
+        if (polled > 0 || hasEvents() || stopped()) {
+            found = true;
+            break;
+        }
+        if (mTimersAdded.load(std::memory_order_relaxed) && mTimersAdded.exchange(false, std::memory_order_relaxed)) {
+            // never spin past the first timer, even one added while spinning
+            const auto timeout = timerTimeout();
+            if (timeout >= std::chrono::nanoseconds{0} && now + timeout < deadline) {
+                deadline = now + timeout;
+                limit = deadline - start;
+            }
+        }
+        if (now >= deadline)
+            break;
+    }
+
+    mBusyPollSpins.fetch_add(1, std::memory_order_relaxed);
+    mBusyPollOffered.fetch_add(limit.count(), std::memory_order_relaxed);
+    if (found) {
+        // the wakeup fd and timer readiness end the spin as well, those aren't hits
+        if (mFdDispatches != dispatches)
+            mBusyPollHits.fetch_add(1, std::memory_order_relaxed);
+        if (now < deadline)
+            mBusyPollUnused.fetch_add((deadline - now).count(), std::memory_order_relaxed);
+    }
+    return found;
+}
+
+Loop::Dispatch Loop::dispatch() const
+{
+    Dispatch dispatch;
+    const int64_t awake = mAwakeSince.load(std::memory_order_acquire);
+    if (!awake)
+        return dispatch;
+    const int64_t now = steadyNanoseconds();
+    dispatch.awake = std::chrono::nanoseconds{std::max<int64_t>(now - awake, 0)};
+
+    // the loop thread keeps going while we look, only trust what we read if the
+    // dispatch it belongs to is still the same one afterwards
+    const int64_t since = mDispatchSince.load(std::memory_order_acquire);
+    if (!since)
+        return dispatch;
+    const auto kind = static_cast<DispatchKind>(mDispatchKind.load(std::memory_order_relaxed));
+    const std::type_info* type = mDispatchType.load(std::memory_order_relaxed);
+    const int fd = mDispatchFd.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (mDispatchSince.load(std::memory_order_relaxed) != since)
+        return dispatch;
+    dispatch.kind = kind;
+    dispatch.type = type;
+    dispatch.fd = fd;
+    dispatch.running = std::chrono::nanoseconds{std::max<int64_t>(now - since, 0)};
+    return dispatch;
+}
+
+void Loop::retryFd(int fd, uint8_t flags)
+{
+    assert(isLoopThread());
+    assert(!(flags & (FdError | FdEdgeWrite)));
+
+    for (auto& retry : mRetryFds) {
+        if (retry.first == fd) {
+            retry.second |= flags;
+            return;
+        }
+    }
+    mRetryFds.push_back(std::make_pair(fd, flags));
+}
+
+void Loop::processRetryFds()
+{
+    if (mRetryFds.empty())
+        return;
+    // callbacks are likely to ask for another retry
+    std::vector<std::pair<int, uint8_t> > retries;
+    retries.swap(mRetryFds);
+    for (const auto& retry : retries) {
+        processFd(retry.first, retry.second);
+    }
+}
+
+void Loop::adaptMaxEvents(int count)
+{
+    if (count >= mMaxEvents) {
+        // there's probably more where that came from
+        mMaxEvents = std::min<int>(mMaxEvents * 2, MaxEvents);
+        mSmallPolls = 0;
+    } else if (mMaxEvents > MinEvents && count < mMaxEvents / 4) {
+        if (++mSmallPolls >= ShrinkAfter) {
+            mMaxEvents /= 2;
+            mSmallPolls = 0;
+        }
+    } else {
+        mSmallPolls = 0;
+    }
+}
+
+Loop::Hook Loop::addHook(HookKind kind, HookFunction&& func)
+{
+    Hook hook;
+    hook.mId = mNextHookId.fetch_add(1, std::memory_order_relaxed) + 1;
+    hook.mLoop = shared_from_this();
+
+    auto entry = std::make_unique<HookFunction>(std::move(func));
+    if (isLoopThread()) {
+        applyAddHook(kind, hook.mId, std::move(entry));
+    } else {
+        post([this, kind, id = hook.mId, entry = std::move(entry)]() mutable {
+            applyAddHook(kind, id, std::move(entry));
+        });
+    }
+    return hook;
+}
+
+void Loop::applyAddHook(HookKind kind, uint32_t id, std::unique_ptr<HookFunction>&& func)
+{
+    auto& hooks = kind == IdleHook ? mIdleHooks : mBeforeWaitHooks;
+    hooks.push_back({ id, false, std::move(func) });
+}
+
+void Loop::removeHook(uint32_t id)
+{
+    if (!isLoopThread()) {
+        post([this, id]() {
+            removeHook(id);
+        });
+        return;
+    }
+    for (auto* hooks : { &mIdleHooks, &mBeforeWaitHooks }) {
+        for (auto& entry : *hooks) {
+            if (entry.id == id) {
+                entry.removed = true;
+                mHooksRemoved = true;
+                return;
+            }
+        }
+    }
+}
+
+void Loop::runHooks()
+{
+    auto run = [this](std::vector<HookEntry>& hooks) {
+        // hooks added by a hook wait for the next round
+        const size_t count = hooks.size();
+        for (size_t i = 0; i < count; ++i) {
+            if (hooks[i].removed)
+                continue;
+            HookFunction* func = hooks[i].func.get();
+            beginDispatch(func);
+            (*func)();
+            endDispatch();
+        }
+    };
+
+    // only idle if nothing is waiting for us
+    if (!mIdleHooks.empty() && !hasEvents() && mRetryFds.empty()
+        && timerTimeout() != std::chrono::nanoseconds{0}) {
+        run(mIdleHooks);
+    }
+    if (!mBeforeWaitHooks.empty())
+        run(mBeforeWaitHooks);
+
+    if (mHooksRemoved) {
+        for (auto* hooks : { &mIdleHooks, &mBeforeWaitHooks }) {
+            hooks->erase(std::remove_if(hooks->begin(), hooks->end(), [](const HookEntry& entry) {
+                return entry.removed;
+            }), hooks->end());
+        }
+        mHooksRemoved = false;
+    }
+}
+
+void Loop::addSignalCallback(int signo, std::unique_ptr<SignalCallback>&& callback)
+{
+    assert(signo > 0 && signo < NSIG);
+#ifdef HAVE_SIGNALFD
+    // the loop thread blocks it too, but it has to be blocked wherever we're called
+    // from as well or it'll just get delivered here
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+#endif
+    if (isLoopThread()) {
+        applyAddSignal(signo, std::move(callback));
+    } else {
+        post([this, signo, callback = std::move(callback)]() mutable {
+            applyAddSignal(signo, std::move(callback));
+        });
+    }
+}
+
+void Loop::applyAddSignal(int signo, std::unique_ptr<SignalCallback>&& callback)
+{
+    assert(isLoopThread());
+
+    if (static_cast<size_t>(signo) >= mSignalCallbacks.size())
+        mSignalCallbacks.resize(signo + 1);
+    // the old callback might be the one that's currently running
+    if (mSignalCallbacks[signo])
+        mDeadSignalCallbacks.push_back(std::move(mSignalCallbacks[signo]));
+    mSignalCallbacks[signo] = std::move(callback);
+
+    const bool first = mSignalFd[0] == -1;
+#ifdef HAVE_SIGNALFD
+    sigaddset(&mSignalMask, signo);
+    pthread_sigmask(SIG_BLOCK, &mSignalMask, nullptr);
+    // passing the fd we have updates its mask
+    const int fd = signalfd(mSignalFd[0], &mSignalMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        Log(Log::Error) << "unable to make signalfd for signal" << signo << errno;
+        return;
+    }
+    mSignalFd[0] = mSignalFd[1] = fd;
+#else
+    if (first) {
+        if (pipe(mSignalFd) == -1) {
+            Log(Log::Error) << "unable to make signal pipe" << errno;
+            mSignalFd[0] = mSignalFd[1] = -1;
+            return;
+        }
+        util::socket::setFlag(mSignalFd[0], O_NONBLOCK);
+        util::socket::setFlag(mSignalFd[1], O_NONBLOCK);
+        fcntl(mSignalFd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(mSignalFd[1], F_SETFD, FD_CLOEXEC);
+    }
+    sSignalPipes[signo].store(mSignalFd[1] + 1);
+    struct sigaction action = {};
+    action.sa_handler = signalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signo, &action, nullptr) == -1) {
+        Log(Log::Error) << "unable to install handler for signal" << signo << errno;
+        return;
+    }
+#endif
+    if (first) {
+        applyAddFd(mSignalFd[0], FdRead, std::make_unique<FdCallback>([this](int, uint8_t) {
+            readSignals();
+        }));
+    }
+}
+
+void Loop::removeSignal(int signo)
+{
+    if (!isLoopThread()) {
+        post([this, signo]() {
+            applyRemoveSignal(signo);
+        });
+        return;
+    }
+    applyRemoveSignal(signo);
+}
+
+void Loop::applyRemoveSignal(int signo)
+{
+    assert(isLoopThread());
+
+    if (static_cast<size_t>(signo) >= mSignalCallbacks.size() || !mSignalCallbacks[signo])
+        return;
+    mDeadSignalCallbacks.push_back(std::move(mSignalCallbacks[signo]));
+#ifdef HAVE_SIGNALFD
+    // unblocking could have it kill us if one is pending, so it stays blocked
+    sigdelset(&mSignalMask, signo);
+    signalfd(mSignalFd[0], &mSignalMask, SFD_NONBLOCK | SFD_CLOEXEC);
+#else
+    struct sigaction action = {};
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(signo, &action, nullptr);
+    sSignalPipes[signo].store(0);
+#endif
+}
+
+void Loop::readSignals()
+{
+#ifdef HAVE_SIGNALFD
+    struct signalfd_siginfo infos[16];
+    const size_t size = sizeof(struct signalfd_siginfo);
+#else
+    unsigned char infos[64];
+    const size_t size = 1;
+#endif
+    for (;;) {
+        ssize_t r;
+        eintrwrap(r, read(mSignalFd[0], infos, sizeof(infos)));
+        if (r <= 0)
+            break;
+        for (size_t i = 0; i < static_cast<size_t>(r) / size; ++i) {
+#ifdef HAVE_SIGNALFD
+            const int signo = static_cast<int>(infos[i].ssi_signo);
+#else
+            const int signo = infos[i];
+#endif
+            if (static_cast<size_t>(signo) < mSignalCallbacks.size() && mSignalCallbacks[signo]) {
+                SignalCallback* callback = mSignalCallbacks[signo].get();
+                (*callback)(signo);
+            }
+        }
+    }
+}
+
+void Loop::closeSignals()
+{
+    if (mSignalFd[0] == -1)
+        return;
+#ifndef HAVE_SIGNALFD
+    // we might not be on the loop thread anymore, put the default handlers back directly
+    struct sigaction action = {};
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    for (size_t signo = 0; signo < mSignalCallbacks.size(); ++signo) {
+        if (mSignalCallbacks[signo]) {
+            sigaction(signo, &action, nullptr);
+            sSignalPipes[signo].store(0);
+        }
+    }
+#endif
+    int e;
+    if (mSignalFd[1] != mSignalFd[0])
+        eintrwrap(e, close(mSignalFd[1]));
+    eintrwrap(e, close(mSignalFd[0]));
+    mSignalFd[0] = mSignalFd[1] = -1;
+    mSignalCallbacks.clear();
+    mDeadSignalCallbacks.clear();
+}
+
+void Loop::reapFds()
+{
+    // we're not inside any fd callback at this point so it's safe to let go of the dead ones.
+    // their destructors might call back into us, hence the swap
+    std::vector<std::unique_ptr<FdCallback> > dead;
+    dead.swap(mDeadFdCallbacks);
+    dead.clear();
+    if (!mDeadSignalCallbacks.empty()) {
+        std::vector<std::unique_ptr<SignalCallback> > deadSignals;
+        deadSignals.swap(mDeadSignalCallbacks);
+    }
+
+    int e;
+    for (int fd : mClosingFds) {
+        eintrwrap(e, close(fd));
+    }
+    mClosingFds.clear();
+}
+
+void Loop::processFd(int fd, uint8_t flags)
+{
+    if (static_cast<size_t>(fd) >= mFdTable.size())
+        return;
+    FdEntry& entry = mFdTable[fd];
+    if (!entry.registered) {
+        // left over from a registration that has since been removed
+        return;
+    }
+    if (flags & FdError) {
+        // the backend has already dropped the fd, it gets closed with the removed ones so
+        // the number can't be reused while the rest of the batch is dispatched
+        entry.registered = false;
+        entry.applied = 0;
+        std::unique_ptr<FdCallback> callback = std::move(entry.callback);
+        if (callback) {
+            ++mFdDispatches;
+            beginDispatch(fd, callback.get());
+            (*callback)(fd, flags);
+            endDispatch();
+        }
+        mClosingFds.push_back(fd);
+        // let it go, it stays alive until the next reap
+        if (callback)
+            mDeadFdCallbacks.push_back(std::move(callback));
+        return;
+    }
+    FdCallback* callback = entry.callback.get();
+    if (!callback)
+        return;
+    if ((flags & FdWrite) && !(entry.flags & FdWrite)) {
+        // FdEdgeWrite without anyone asking for write events
+        return;
+    }
+
+    ++mFdDispatches;
+    beginDispatch(fd, callback);
+    (*callback)(fd, flags);
+    endDispatch();
+}
+
+std::chrono::nanoseconds Loop::timerTimeout()
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    if (mTimers.empty())
+        return std::chrono::nanoseconds{-1};
+    const auto now = this->now();
+    const auto next = mTimers.next();
+    if (now >= next)
+        return std::chrono::nanoseconds{0};
+    return next - now;
+}
+
+void Loop::fireTimers()
+{
+    std::vector<std::shared_ptr<Timer> > timers;
+    {
+        auto now = this->now();
+
+        std::lock_guard<std::mutex> locker(mMutex);
+        mTimers.expire(now, [&timers](std::shared_ptr<Timer>&& timer) {
+            timers.push_back(std::move(timer));
+        });
+        // put intervals back before executing so that they can stop themselves
+        for (const auto& t : timers) {
+            if (t->mFlag == Interval) {
+                // keep the cadence, unless we've fallen a whole interval behind
+                auto deadline = t->mDeadline + t->mTimeout;
+                if (deadline <= now)
+                    deadline = now + t->mTimeout;
+                scheduleTimer(t.get(), deadline);
+                mTimers.insert(std::shared_ptr<Timer>(t));
+            }
+        }
+    }
+    for (const auto& t : timers) {
+        beginDispatch(t.get());
+        t->execute();
+        endDispatch();
+    }
+}
+
+void Loop::advanceTo(TimePoint time)
+{
+    assert(mClockMode == VirtualClock);
+    const int64_t to = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    int64_t current = mVirtualNow.load(std::memory_order_relaxed);
+    while (current < to && !mVirtualNow.compare_exchange_weak(current, to, std::memory_order_acq_rel)) {
+    }
+    // timers might have come due
+    wakeup();
+}
+
+void Loop::setTimerResolution(std::chrono::nanoseconds resolution)
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    if (!mTimers.empty()) {
+        Log(Log::Error) << "can't change timer resolution with active timers";
+        return;
+    }
+    mTimers.setResolution(resolution);
+}
+
+void Loop::setTimerSlack(std::chrono::nanoseconds slack)
+{
+    // only affects timers added from now on
+    std::lock_guard<std::mutex> locker(mMutex);
+    mTimerSlack = std::max<std::chrono::nanoseconds>(slack, std::chrono::nanoseconds{0});
+}
+
+int Loop::iterate(std::chrono::nanoseconds maxWait, std::chrono::nanoseconds maxBlock)
+{
+    mIterating = true;
+
+    // execute all events
+    if (!processEvents()) {
+        // shutdown threads etc
+        mIterating = false;
+        flushBatches();
+        mArena.reset();
+        return 0;
+    }
+
+    reapFds();
+    runHooks();
+    // whatever the events and hooks batched up has to go out before we might block,
+    // the fd callbacks and timers below get flushed at the end
+    flushBatches();
+
+    // waiting, or spinning while we wait, isn't stalling
+    markAwake(false);
+
+    // spin for a bit before going to sleep, but never past the first timer
+    bool spun = false;
+    if (mBusyPollBudget > std::chrono::nanoseconds{0} && mRetryFds.empty()) {
+        auto limit = std::min<std::chrono::nanoseconds>(mBusyPollBudget, timerTimeout());
+        if (limit < std::chrono::nanoseconds{0})
+            limit = mBusyPollBudget;
+        if (maxWait >= std::chrono::nanoseconds{0})
+            limit = std::min<std::chrono::nanoseconds>(limit, maxWait);
+        if (limit > std::chrono::nanoseconds{0})
+            spun = busyPoll(limit);
+    }
+    if (spun)
+        markAwake(true);
+
+    if (!spun) {
+        // from here on other threads need to wake us up. anything they changed
+        // before this point is picked up below
+        mWaitState.store(Polling);
+
+        // when is our first timer?
+        auto waitTimeout = timerTimeout();
+        if (maxWait >= std::chrono::nanoseconds{0}) {
+            if (waitTimeout < std::chrono::nanoseconds{0} || maxWait < waitTimeout)
+                waitTimeout = maxWait;
+        }
+        if (hasEvents() || !mRetryFds.empty())
+            waitTimeout = std::chrono::nanoseconds{0};
+
+        int polled;
+        if (mClockMode == VirtualClock && waitTimeout > std::chrono::nanoseconds{0}) {
+            // time doesn't pass while a virtual clock waits, either we move it
+            // ourselves or we wait for advance()
+            if (mAutoAdvance.load(std::memory_order_relaxed)) {
+                polled = poll(std::chrono::nanoseconds{0});
+                if (polled == 0 && !hasEvents() && !stopped())
+                    advanceTo(now() + waitTimeout);
+            } else {
+                polled = poll(maxBlock);
+            }
+        } else {
+            polled = poll(waitTimeout);
+        }
+        mWaitState.store(Running);
+        markAwake(true);
+        if (polled < 0) {
+            // bad
+            Log(Log::Error) << "unable to wait for events" << errno;
+            markAwake(false);
+            mIterating = false;
+            flushBatches();
+            cleanup();
+            return -1;
+        }
+    }
+
+    processRetryFds();
+    fireTimers();
+
+    mIterating = false;
+    flushBatches();
+    // nothing dispatched this round is running anymore
+    mArena.reset();
+    return 1;
+}
+
+void Loop::batch(Loop* target, Event* event)
+{
+    assert(isLoopThread());
+    event->mNextEvent = nullptr;
+    for (auto& batch : mBatches) {
+        if (batch.key != target)
+            continue;
+        if (batch.loop.expired()) {
+            // a new loop where a dead one used to be, drop what was meant for that one
+            BatchEvent dropped(batch.head);
+            batch = { target->weak_from_this(), target, nullptr, nullptr };
+        }
+        if (batch.tail) {
+            batch.tail->mNextEvent = event;
+        } else {
+            batch.head = event;
+        }
+        batch.tail = event;
+        return;
+    }
+    mBatches.push_back({ target->weak_from_this(), target, event, event });
+}
+
+void Loop::flushBatches()
+{
+    auto it = mBatches.begin();
+    while (it != mBatches.end()) {
+        if (!it->head) {
+            // keep the entry around for the next round unless its loop is gone
+            if (it->loop.expired()) {
+                it = mBatches.erase(it);
+            } else {
+                ++it;
+            }
+            continue;
+        }
+        std::unique_ptr<Event> event(new BatchEvent(it->head));
+        it->head = it->tail = nullptr;
+        if (auto loop = it->loop.lock()) {
+            loop->post(std::move(event));
+            ++it;
+        } else {
+            it = mBatches.erase(it);
+        }
+    }
+}
+
+int Loop::execute(std::chrono::milliseconds timeout)
+{
+    assert(tLoop.lock() != std::shared_ptr<Loop>());
+
+    const bool hasTimeout = timeout != std::chrono::milliseconds{-1};
+    const auto executeDeadline = now() + timeout;
+
+    markAwake(true);
+    for (;;) {
+        std::chrono::nanoseconds maxWait{-1};
+        if (hasTimeout)
+            maxWait = std::max<std::chrono::nanoseconds>(executeDeadline - now(), std::chrono::nanoseconds{0});
+
+        const int result = iterate(maxWait, std::chrono::nanoseconds{-1});
+        if (result <= 0) {
+            if (result < 0)
+                return -1;
+            markAwake(false);
+            return mStatus;
+        }
+
+        if (hasTimeout && now() >= executeDeadline) {
+            markAwake(false);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+bool Loop::runOnce(std::chrono::nanoseconds timeout)
+{
+    assert(isLoopThread());
+
+    mWaitState.store(Running);
+    markAwake(true);
+    const int result = iterate(timeout, timeout);
+    if (result < 0)
+        return false;
+    markAwake(false);
+
+    // the host waits on fd() until we're called again, make sure that's enough to
+    // get us going. registrations the backend queued up need to reach the kernel and
+    // posts from other threads need to write the wakeup fd
+    flushFds();
+    mWaitState.store(Polling);
+    return result > 0;
+}
+
+std::chrono::nanoseconds Loop::nextTimeout()
+{
+    assert(isLoopThread());
+
+    if (stopped() || hasEvents() || !mRetryFds.empty())
+        return std::chrono::nanoseconds{0};
+    return timerTimeout();
+}
@@ -0,0 +1,83 @@
+#include <event/LoopGroup.h>
+#include <log/Log.h>
+#include <util/Thread.h>
+#include "config.h"
+
+using namespace reckoning;
+using namespace reckoning::event;
+using namespace reckoning::log;
+
+void LoopGroup::init()
+{
+    // a restricted cpuset only gets as many loops as it has cpus, and only those
+    mAllowed = util::thread::affinity();
+    if (!mCount)
+        mCount = mAllowed.empty() ? std::max(std::thread::hardware_concurrency(), 1u) : mAllowed.size();
+
+    mLoops.resize(mCount);
+    mThreads.reserve(mCount);
+    for (size_t i = 0; i < mCount; ++i) {
+        mThreads.push_back(std::thread(&LoopGroup::run, this, i));
+    }
+
+    // wait for all the loops to be created so that loops() is usable right away
+    std::unique_lock<std::mutex> locker(mMutex);
+    while (mStarted < mCount) {
+        mCond.wait(locker);
+    }
+}
+
+void LoopGroup::run(size_t index)
+{
+    util::thread::setName(mName + std::to_string(index));
+
+    // placement comes first so that everything the loop allocates, starting with
+    // itself, lands where it's going to be used
+    if (!mCpus.empty()) {
+        if (!util::thread::setAffinity(mCpus[index % mCpus.size()])) {
+            Log(Log::Warn) << "unable to pin loop" << index << "to its cpu set" << errno;
+        }
+    } else if (!(mFlags & NoPinning)) {
+#ifdef HAVE_PTHREAD_AFFINITY
+        // quietly skipped where pinning isn't a thing or we don't know where we may run
+        if (!mAllowed.empty()) {
+            const unsigned int cpu = mAllowed[index % mAllowed.size()];
+            if (!util::thread::setAffinity({ cpu })) {
+                Log(Log::Warn) << "unable to pin loop" << index << "to core" << cpu << errno;
+            }
+        }
+#endif
+    }
+    if (mFlags & LocalMemory) {
+        // the node we've just been moved to, the loop, its arena and the thread local
+        // pools are all allocated on this thread from here on
+        const int node = util::thread::numaNode();
+        if (node < 0 || !util::thread::setMemoryNode(node)) {
+            Log(Log::Warn) << "unable to use local memory for loop" << index << errno;
+        }
+    }
+
+    auto loop = Loop::create();
+    {
+        std::lock_guard<std::mutex> locker(mMutex);
+        mLoops[index] = loop;
+        ++mStarted;
+    }
+    mCond.notify_one();
+
+    loop->execute();
+}
+
+void LoopGroup::stop(int status)
+{
+    for (const auto& loop : mLoops) {
+        assert(!loop || !loop->isLoopThread());
+        if (loop)
+            loop->exit(status);
+    }
+    for (auto& thread : mThreads) {
+        if (thread.joinable())
+            thread.join();
+    }
+    mThreads.clear();
+}
@@ -6,7 +6,9 @@
 #include <fcntl.h>
 #include <log/Log.h>
 #include <util/Socket.h>
-#include <net/Resolver.h>
+#ifdef HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif
 
 #ifdef __linux__
 #include <linux/version.h>
@@ -46,250 +48,141 @@ void Loop::init()
         cleanup();
         return;
     }
+
+#ifdef HAVE_TIMERFD
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mTimerFd == -1) {
+        // not fatal, waits get rounded up to whole milliseconds
+        Log(Log::Warn) << "unable to make timerfd for eventloop" << errno;
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = mTimerFd;
+    e = epoll_ctl(mFd, EPOLL_CTL_ADD, mTimerFd, &ev);
+    if (e == -1) {
+        Log(Log::Warn) << "unable to add timerfd to epoll" << errno;
+        eintrwrap(e, ::close(mTimerFd));
+        mTimerFd = -1;
+    }
+#endif
 }
 
 void Loop::deinit()
 {
-    net::Resolver::resolver().shutdown();
+#ifdef HAVE_TIMERFD
+    if (mTimerFd != -1) {
+        int e;
+        eintrwrap(e, ::close(mTimerFd));
+        mTimerFd = -1;
+    }
+#endif
 }
 
-int Loop::execute(std::chrono::milliseconds timeout)
+// everything is edge triggered already so FdEdgeWrite needs nothing special
+static inline uint32_t epollEvents(uint8_t flags)
 {
-    assert(tLoop.lock() != std::shared_ptr<Loop>());
-
-    int executeTimeout;
-    bool hasTimeout;
-    if (timeout != std::chrono::milliseconds{-1}) {
-        //addTimer(timeout, [this]() { exit(); });
-        executeTimeout = timeout.count();
-        hasTimeout = true;
-    } else {
-        executeTimeout = std::numeric_limits<int>::max();
-        hasTimeout = false;
-    }
-    int64_t startTime = timeNow();
-
-    auto resort = [](std::vector<std::shared_ptr<Timer> >& timers) {
-        auto compare = [](const std::shared_ptr<Timer>& a, const std::shared_ptr<Timer>& b) -> bool {
-            return a->mNext < b->mNext;
-        };
-        std::sort(timers.begin(), timers.end(), compare);
-    };
-
-    auto processFd = [this](int fd, uint8_t flags)
-        {
-            std::unique_lock<std::mutex> locker(mMutex);
-            auto it = mFds.begin();
-            const auto end = mFds.end();
-            while (it != end) {
-                if (it->first == fd) {
-                    if (flags & FdError) {
-                        // let it go
-                        mFds.erase(it);
-                    }
-
-                    auto func = it->second;
-                    locker.unlock();
-                    func(fd, flags);
-                    return;
-                }
-                ++it;
-            }
-        };
-
-    int epollTimeout;
+    uint32_t events = EPOLLRDHUP | EPOLLET;
+    if (flags & Loop::FdRead)
+        events |= EPOLLIN;
+    if (flags & Loop::FdWrite)
+        events |= EPOLLOUT;
+    return events;
+}
 
-    std::vector<std::unique_ptr<Event> > events;
-    std::vector<std::shared_ptr<Timer> > timers;
-    std::vector<int> fds;
+void Loop::registerFd(int fd, uint8_t flags)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = epollEvents(flags);
+    ev.data.fd = fd;
+    epoll_ctl(mFd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-    enum { MaxEvents = 64 };
-    struct epoll_event epevents[MaxEvents];
-    int e;
-    for (;;) {
-        // execute all events
-        for (;;) {
-            {
-                // are we stopped?
-                if (mStopped.load(std::memory_order_acquire)) {
-                    // shutdown threads etc
-                    return mStatus;
-                }
+void Loop::modifyFd(int fd, uint8_t flags)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = epollEvents(flags);
+    epoll_ctl(mFd, EPOLL_CTL_MOD, fd, &ev);
+}
 
-                std::lock_guard<std::mutex> locker(mMutex);
-                events = std::move(mEvents);
-                if (events.empty())
-                    break;
-            }
-            for (const auto& e : events) {
-                e->execute();
-            }
-        }
+void Loop::unregisterFd(int fd)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    epoll_ctl(mFd, EPOLL_CTL_DEL, fd, &ev);
+}
 
-        // process new fds
-        {
-            // did one of the events stop us?
-            if (mStopped.load(std::memory_order_acquire)) {
-                // shutdown threads etc
-                return mStatus;
-            }
+void Loop::flushFds()
+{
+    // changes are applied right away
+}
 
-            std::lock_guard<std::mutex> locker(mMutex);
-            if (!mPendingFds.empty()) {
-                fds.clear();
-                fds.reserve(mPendingFds.size());
-                for (const auto &fd : mPendingFds) {
-                    fds.push_back(fd.first);
-                }
-                // these might be duplicated in mFds (in case someone removes and readds before the event loop has a time to process)
-                // so we need to remove them if they do
-                auto fit = mFds.begin();
-                while (fit != mFds.end()) {
-                    for (const auto& pending : mPendingFds) {
-                        if (pending.first == fit->first) {
-                            // remove it
-                            fit = mFds.erase(fit);
-                        } else {
-                            ++fit;
-                        }
-                    }
-                }
-                mFds.insert(mFds.end(), std::make_move_iterator(mPendingFds.begin()), std::make_move_iterator(mPendingFds.end()));
-                mPendingFds.clear();
-            }
-        }
-        // add new fds
-        if (!fds.empty()) {
-            struct epoll_event ev;
-            memset(&ev, 0, sizeof(struct epoll_event));
-            for (auto fd : fds) {
-                ev.events = EPOLLRDHUP | EPOLLET | EPOLLIN;
-                ev.data.fd = fd;
-                e = epoll_ctl(mFd, EPOLL_CTL_ADD, fd, &ev);
-            }
-            fds.clear();
+int Loop::poll(std::chrono::nanoseconds timeout)
+{
+    int epollTimeout = -1;
+    if (timeout >= std::chrono::nanoseconds{0}) {
+#ifdef HAVE_TIMERFD
+        if (mTimerFd != -1 && timeout % std::chrono::milliseconds{1} != std::chrono::nanoseconds{0}) {
+            // let the timerfd wake us up at the exact time. a timer armed earlier that
+            // we don't need anymore is left alone, at worst it wakes us up for nothing
+            itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            const auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+            spec.it_value.tv_sec = secs.count();
+            spec.it_value.tv_nsec = (timeout - secs).count();
+            if (timerfd_settime(mTimerFd, 0, &spec, nullptr) == 0)
+                timeout = std::chrono::nanoseconds{-1};
         }
-        // when is our first timer?
+        if (timeout >= std::chrono::nanoseconds{0})
+#endif
         {
-            std::lock_guard<std::mutex> locker(mMutex);
-            if (!mTimers.empty()) {
-                auto now = std::chrono::steady_clock::now();
-                if (now <= mTimers.front()->mNext) {
-                    const auto when = mTimers.front()->mNext - now;
-                    const auto mscount = std::chrono::duration_cast<std::chrono::milliseconds>(when).count();
-                    epollTimeout = std::min<int>(mscount, std::numeric_limits<int>::max());
-                } else {
-                    epollTimeout = 0;
-                }
-            } else {
-                epollTimeout = hasTimeout ? executeTimeout : -1;
-            }
-
-            // also, while we have the mutex, process removed fds
-            fds = std::move(mRemovedFds);
-
-            // and update sockets, hopefully we won't have too many of these
-            if (!mUpdateFds.empty()) {
-                struct epoll_event ev;
-                memset(&ev, 0, sizeof(struct epoll_event));
-                for (auto update : mUpdateFds) {
-                    ev.data.fd = update.first;
-                    ev.events = EPOLLRDHUP | EPOLLET;
-                    if (update.second & FdRead)
-                        ev.events |= EPOLLIN;
-                    if (update.second & FdWrite)
-                        ev.events |= EPOLLOUT;
-                    e = epoll_ctl(mFd, EPOLL_CTL_MOD, update.first, &ev);
-                }
-                mUpdateFds.clear();
-            }
-        }
-        // remove fds
-        if (!fds.empty()) {
-            struct epoll_event ev;
-            memset(&ev, 0, sizeof(struct epoll_event));
-            for (auto fd : fds) {
-                e = epoll_ctl(mFd, EPOLL_CTL_DEL, fd, &ev);
-                eintrwrap(e, close(fd));
-            }
-            fds.clear();
-        }
-
-        eintrwrap(e, epoll_wait(mFd, epevents, MaxEvents, std::min(executeTimeout, epollTimeout)));
-        if (e < 0) {
-            // bad
-            Log(Log::Error) << "unable to wait for events" << errno;
-            cleanup();
-            return -1;
+            // round up, waking up before the first timer is due only to go straight back to sleep is pointless
+            const auto mscount = std::chrono::ceil<std::chrono::milliseconds>(timeout).count();
+            epollTimeout = std::min<int64_t>(mscount, std::numeric_limits<int>::max());
         }
+    }
 
-        // printf("got %d events\n", e);
+    if (mPollEvents.size() < static_cast<size_t>(mMaxEvents))
+        mPollEvents.resize(mMaxEvents);
+    struct epoll_event* epevents = mPollEvents.data();
+    int e;
+    eintrwrap(e, epoll_wait(mFd, epevents, mMaxEvents, epollTimeout));
+    if (e < 0) {
+        return -1;
+    }
 
-        for (int i = 0; i < e; ++i) {
-            const uint32_t ev = epevents[i].events;
-            const int fd = epevents[i].data.fd;
-            if (ev & (EPOLLERR | EPOLLHUP) && !(ev & EPOLLRDHUP)) {
-                // badness, we want this thing out
-                epoll_ctl(mFd, EPOLL_CTL_DEL, fd, &epevents[i]);
-                processFd(fd, FdError);
-                eintrwrap(e, ::close(fd));
-                continue;
-            }
-            if (ev & (EPOLLIN | EPOLLRDHUP)) {
-                // read event
-                if (fd == mWakeup[0]) {
-                    // read and discard
-                    char c;
-                    do {
-                        eintrwrap(e, read(fd, &c, 1));
-                    } while (e == 1);
-                } else {
-                    processFd(fd, FdRead);
-                }
-            }
-            if (ev & EPOLLOUT) {
-                // write event
-                processFd(fd, FdWrite);
-            }
+    // printf("got %d events\n", e);
+
+    const int count = e;
+    adaptMaxEvents(count);
+    for (int i = 0; i < count; ++i) {
+        const uint32_t ev = epevents[i].events;
+        const int fd = epevents[i].data.fd;
+        if (ev & (EPOLLERR | EPOLLHUP) && !(ev & EPOLLRDHUP)) {
+            // badness, we want this thing out
+            epoll_ctl(mFd, EPOLL_CTL_DEL, fd, &epevents[i]);
+            processFd(fd, FdError);
+            continue;
         }
-
-        // fire timers
-        {
-            auto now = std::chrono::steady_clock::now();
-
-            std::lock_guard<std::mutex> locker(mMutex);
-            auto it = mTimers.begin();
-            auto end = mTimers.cend();
-            while (it != end) {
-                if ((*it)->mNext <= now) {
-                    timers.push_back(*it);
-                    if ((*it)->mFlag == Timeout) {
-                        it = mTimers.erase(it);
-                        end = mTimers.cend();
-                    } else {
-                        (*it)->mNext = now + (*it)->mTimeout;
-                        ++it;
-                    }
-                } else {
-                    break;
-                }
+        if (ev & (EPOLLIN | EPOLLRDHUP)) {
+            // read event
+            if (fd == mWakeup[0]) {
+                readWakeup();
+#ifdef HAVE_TIMERFD
+            } else if (fd == mTimerFd) {
+                uint64_t expirations;
+                eintrwrap(e, ::read(mTimerFd, &expirations, sizeof(expirations)));
+#endif
+            } else {
+                processFd(fd, FdRead);
             }
-            resort(mTimers);
         }
-        for (const auto& t : timers) {
-            t->execute();
-        }
-        timers.clear();
-
-        if (hasTimeout) {
-            const int64_t now = timeNow();
-            executeTimeout -= (now - startTime);
-            startTime = now;
-
-            if (executeTimeout <= 0) {
-                return 0;
-            }
+        if (ev & EPOLLOUT) {
+            // write event
+            processFd(fd, FdWrite);
         }
     }
-    return 0;
+    return count;
 }
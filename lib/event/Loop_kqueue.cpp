@@ -6,7 +6,6 @@
 #include <fcntl.h>
 #include <log/Log.h>
 #include <util/Socket.h>
-#include <net/Resolver.h>
 
 using namespace reckoning;
 using namespace reckoning::event;
@@ -41,292 +40,135 @@ void Loop::init()
 
 void Loop::deinit()
 {
-    net::Resolver::resolver().shutdown();
 }
 
-int Loop::execute(std::chrono::milliseconds timeout)
+void Loop::registerFd(int fd, uint8_t flags)
 {
-    assert(tLoop.lock() != std::shared_ptr<Loop>());
+    // printf("adding fd %d\n", fd);
+    int e;
+    struct kevent ev[2];
+    int count = 0;
+    memset(&ev, 0, sizeof(ev));
+    if (flags & FdRead) {
+        ev[count].ident = fd;
+        // edge triggered like the other backends, callbacks that stop short of EAGAIN
+        // use retryFd and would otherwise get dispatched twice
+        ev[count].flags = EV_ADD|EV_ENABLE|EV_CLEAR;
+        ev[count].filter = EVFILT_READ;
+        ++count;
+    }
+    if (flags & FdWrite) {
+        ev[count].ident = fd;
+        // FdEdgeWrite wants to hear about transitions only
+        ev[count].flags = EV_ADD|EV_ENABLE|((flags & FdEdgeWrite) ? EV_CLEAR : 0);
+        ev[count].filter = EVFILT_WRITE;
+        ++count;
+    }
+    if (count) {
+        eintrwrap(e, kevent(mFd, ev, count, 0, 0, 0));
+    }
+}
 
-    int executeTimeout;
-    bool hasTimeout;
-    if (timeout != std::chrono::milliseconds{-1}) {
-        //addTimer(timeout, [this]() { exit(); });
-        executeTimeout = timeout.count();
-        hasTimeout = true;
+void Loop::modifyFd(int fd, uint8_t flags)
+{
+    int e;
+    struct kevent ev;
+    memset(&ev, 0, sizeof(struct kevent));
+    ev.ident = fd;
+    // printf("updating fd %ld with flag %d\n", ev.ident, flags);
+    if (flags & FdRead) {
+        // printf("add read\n");
+        ev.flags = EV_ADD|EV_ENABLE|EV_CLEAR;
+        ev.filter = EVFILT_READ;
+        eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
     } else {
-        executeTimeout = std::numeric_limits<int>::max();
-        hasTimeout = false;
+        // printf("remove read\n");
+        ev.flags = EV_DELETE|EV_DISABLE;
+        ev.filter = EVFILT_READ;
+        eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
     }
-    int64_t startTime = timeNow();
-
-    auto resort = [](std::vector<std::shared_ptr<Timer> >& timers) {
-        auto compare = [](const std::shared_ptr<Timer>& a, const std::shared_ptr<Timer>& b) -> bool {
-            return a->mNext < b->mNext;
-        };
-        std::sort(timers.begin(), timers.end(), compare);
-    };
+    if (flags & FdWrite) {
+        // printf("add write\n");
+        ev.flags = EV_ADD|EV_ENABLE|((flags & FdEdgeWrite) ? EV_CLEAR : 0);
+        ev.filter = EVFILT_WRITE;
+        eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
+    } else {
+        // printf("remove write\n");
+        ev.flags = EV_DELETE|EV_DISABLE;
+        ev.filter = EVFILT_WRITE;
+        eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
+    }
+}
 
-    auto processFd = [this](int fd, uint8_t flags)
-    {
-        std::unique_lock<std::mutex> locker(mMutex);
-        auto it = mFds.begin();
-        const auto end = mFds.end();
-        while (it != end) {
-            if (it->first == fd) {
-                if (flags & FdError) {
-                    // let it go
-                    mFds.erase(it);
-                }
+void Loop::unregisterFd(int fd)
+{
+    // printf("removing fd %d\n", fd);
+    int e;
+    struct kevent ev;
+    memset(&ev, 0, sizeof(struct kevent));
+    ev.ident = fd;
+    ev.flags = EV_DELETE|EV_DISABLE;
+    eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
+}
 
-                auto func = it->second;
-                locker.unlock();
-                func(fd, flags);
-                return;
-            }
-            ++it;
-        }
-    };
+void Loop::flushFds()
+{
+    // changes are applied right away
+}
 
-    timespec ts, ets;
+int Loop::poll(std::chrono::nanoseconds timeout)
+{
+    timespec ts;
     timespec* tsptr = nullptr;
+    if (timeout >= std::chrono::nanoseconds{0}) {
+        ts = std::chrono::duration_cast<timespec>(timeout);
+        tsptr = &ts;
+    }
 
-    std::vector<std::unique_ptr<Event> > events;
-    std::vector<std::shared_ptr<Timer> > timers;
-    std::vector<int> fds;
-
-    enum { MaxEvents = 64 };
-    struct kevent kevents[MaxEvents];
+    if (mPollEvents.size() < static_cast<size_t>(mMaxEvents))
+        mPollEvents.resize(mMaxEvents);
+    struct kevent* kevents = mPollEvents.data();
     int e;
-    for (;;) {
-        // execute all events
-        for (;;) {
-            {
-                // are we stopped?
-                if (mStopped.load(std::memory_order_acquire)) {
-                    return mStatus;
-                }
-
-                std::lock_guard<std::mutex> locker(mMutex);
-                events = std::move(mEvents);
-                if (events.empty())
-                    break;
-            }
-            for (const auto& e : events) {
-                e->execute();
-            }
-        }
-
-        // process new fds
-        {
-            // did one of the events stop us?
-            if (mStopped.load(std::memory_order_acquire)) {
-                return mStatus;
-            }
-
-            std::lock_guard<std::mutex> locker(mMutex);
-            if (!mPendingFds.empty()) {
-                fds.clear();
-                fds.reserve(mPendingFds.size());
-                for (const auto &fd : mPendingFds) {
-                    fds.push_back(fd.first);
-                }
-                // these might be duplicated in mFds (in case someone removes and readds before the event loop has a time to process)
-                // so we need to remove them if they do
-                auto fit = mFds.begin();
-                while (fit != mFds.end()) {
-                    for (const auto& pending : mPendingFds) {
-                        if (pending.first == fit->first) {
-                            // remove it
-                            fit = mFds.erase(fit);
-                        } else {
-                            ++fit;
-                        }
-                    }
-                }
-                mFds.insert(mFds.end(), std::make_move_iterator(mPendingFds.begin()), std::make_move_iterator(mPendingFds.end()));
-                mPendingFds.clear();
-            }
-        }
-        // add new fds
-        if (!fds.empty()) {
-            struct kevent ev;
-            memset(&ev, 0, sizeof(struct kevent));
-            for (auto fd : fds) {
-                // printf("adding fd %d\n", fd);
-                ev.ident = fd;
-                ev.flags = EV_ADD|EV_ENABLE;
-                ev.filter = EVFILT_READ;
-                eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
-            }
-            fds.clear();
-        }
-        // when is our first timer?
-        {
-            if (hasTimeout) {
-                ets.tv_sec = executeTimeout / 1000;
-                ets.tv_nsec = (executeTimeout % 1000) * 1000000;
-            }
-
-            std::lock_guard<std::mutex> locker(mMutex);
-            if (!mTimers.empty()) {
-                auto now = std::chrono::steady_clock::now();
-                tsptr = nullptr;
-                if (now <= mTimers.front()->mNext) {
-                    auto when = mTimers.front()->mNext - now;
-                    ts = std::chrono::duration_cast<timespec>(when);
-                    if (hasTimeout && (ets.tv_sec < ts.tv_sec || (ets.tv_sec == ts.tv_sec && ets.tv_nsec < ts.tv_nsec))) {
-                        tsptr = &ets;
-                    }
-                } else {
-                    memset(&ts, 0, sizeof(ts));
-                }
-                if (tsptr == nullptr) {
-                    tsptr = &ts;
-                }
-            } else if (hasTimeout) {
-                tsptr = &ets;
-            } else {
-                tsptr = nullptr;
-            }
-
-            // also, while we have the mutex, process removed fds
-            fds = std::move(mRemovedFds);
-
-            // and update sockets, hopefully we won't have too many of these
-            if (!mUpdateFds.empty()) {
-                struct kevent ev;
-                memset(&ev, 0, sizeof(struct kevent));
-                for (auto update : mUpdateFds) {
-                    ev.ident = update.first;
-                    // printf("updating fd %ld with flag %d\n", ev.ident, update.second);
-                    if (update.second & FdRead) {
-                        // printf("add read\n");
-                        ev.flags = EV_ADD|EV_ENABLE;
-                        ev.filter = EVFILT_READ;
-                        eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
-                    } else {
-                        // printf("remove read\n");
-                        ev.flags = EV_DELETE|EV_DISABLE;
-                        ev.filter = EVFILT_READ;
-                        eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
-                    }
-                    if (update.second & FdWrite) {
-                        // printf("add write\n");
-                        ev.flags = EV_ADD|EV_ENABLE;
-                        ev.filter = EVFILT_WRITE;
-                        eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
-                    } else {
-                        // printf("remove write\n");
-                        ev.flags = EV_DELETE|EV_DISABLE;
-                        ev.filter = EVFILT_WRITE;
-                        eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
-                    }
-                }
-                mUpdateFds.clear();
-            }
-        }
-        // remove fds
-        if (!fds.empty()) {
-            struct kevent ev;
-            memset(&ev, 0, sizeof(struct kevent));
-            for (auto fd : fds) {
-                // printf("removing fd %d\n", fd);
-                ev.ident = fd;
-                ev.flags = EV_DELETE|EV_DISABLE;
-                eintrwrap(e, kevent(mFd, &ev, 1, 0, 0, 0));
-                eintrwrap(e, close(fd));
-            }
-            fds.clear();
-        }
-
-        eintrwrap(e, kevent(mFd, 0, 0, kevents, MaxEvents, tsptr));
-        if (e < 0) {
-            // bad
-            Log(Log::Error) << "unable to wait for events" << errno;
-            cleanup();
-            return -1;
-        }
-
-        // printf("got %d events\n", e);
-
-        for (int i = 0; i < e; ++i) {
-            const int16_t filter = kevents[i].filter;
-            const uint16_t flags = kevents[i].flags;
-            const int fd = kevents[i].ident;
-
-            // printf("event on fd %d\n", fd);
-
-            if (flags & EV_ERROR) {
-                // badness, we want this thing out
-                struct kevent& kev = kevents[i];
-                Log(Log::Warn) << "error on socket" << fd << kev.data;
-                kev.flags = EV_DELETE|EV_DISABLE;
-                kevent(mFd, &kev, 1, 0, 0, 0);
-
-                processFd(fd, FdError);
-
-                eintrwrap(e, ::close(fd));
-            } else {
-                switch (filter) {
-                case EVFILT_READ:
-                    // read event
-                    if (fd == mWakeup[0]) {
-                        // read and discard
-                        char c;
-                        do {
-                            eintrwrap(e, read(fd, &c, 1));
-                        } while (e == 1);
-                    } else {
-                        processFd(fd, FdRead);
-                    }
-                    break;
-                case EVFILT_WRITE:
-                    // write event;
-                    processFd(fd, FdWrite);
-                    break;
-                }
-            }
-        }
-
-        // fire timers
-        {
-            auto now = std::chrono::steady_clock::now();
+    eintrwrap(e, kevent(mFd, 0, 0, kevents, mMaxEvents, tsptr));
+    if (e < 0) {
+        return -1;
+    }
 
-            std::lock_guard<std::mutex> locker(mMutex);
-            auto it = mTimers.begin();
-            auto end = mTimers.cend();
-            while (it != end) {
-                if ((*it)->mNext <= now) {
-                    timers.push_back(*it);
-                    if ((*it)->mFlag == Timeout) {
-                        it = mTimers.erase(it);
-                        end = mTimers.cend();
-                    } else {
-                        (*it)->mNext = now + (*it)->mTimeout;
-                        ++it;
-                    }
+    // printf("got %d events\n", e);
+
+    const int count = e;
+    adaptMaxEvents(count);
+    for (int i = 0; i < count; ++i) {
+        const int16_t filter = kevents[i].filter;
+        const uint16_t flags = kevents[i].flags;
+        const int fd = kevents[i].ident;
+
+        // printf("event on fd %d\n", fd);
+
+        if (flags & EV_ERROR) {
+            // badness, we want this thing out
+            struct kevent& kev = kevents[i];
+            Log(Log::Warn) << "error on socket" << fd << kev.data;
+            kev.flags = EV_DELETE|EV_DISABLE;
+            kevent(mFd, &kev, 1, 0, 0, 0);
+
+            processFd(fd, FdError);
+        } else {
+            switch (filter) {
+            case EVFILT_READ:
+                // read event
+                if (fd == mWakeup[0]) {
+                    readWakeup();
                 } else {
-                    break;
+                    processFd(fd, FdRead);
                 }
+                break;
+            case EVFILT_WRITE:
+                // write event;
+                processFd(fd, FdWrite);
+                break;
             }
-            resort(mTimers);
         }
-        for (const auto& t : timers) {
-            t->execute();
-        }
-
-        if (hasTimeout) {
-            const int64_t now = timeNow();
-            executeTimeout -= (now - startTime);
-            startTime = now;
-
-            if (executeTimeout <= 0) {
-                return 0;
-            }
-        }
-
-        timers.clear();
     }
-    return 0;
+    return count;
 }
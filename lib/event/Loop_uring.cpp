@@ -0,0 +1,837 @@
+#include <event/Loop.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <log/Log.h>
+#include <util/Socket.h>
+#include <algorithm>
+
+// We talk to io_uring directly rather than through liburing, we only need a small part of it.
+// Readiness works the same as with epoll and kqueue: every fd that asks for it gets a multishot
+// poll request and the callbacks still read() and write() until EAGAIN themselves. What that
+// saves is the registration syscalls, all changes queued during an iteration are submitted by
+// the same io_uring_enter() that waits for completions, so adding, updating and removing fds
+// doesn't cost a syscall each like epoll_ctl() does. On top of that acceptMultishot(),
+// recvMultishot() and sendv() hand the operations themselves to the ring, which is what plain
+// TcpServer and TcpSocket use: a multishot accept, a multishot recv into a ring of buffers we
+// provide and a sendmsg per batch of writes. those take the wait, read, EAGAIN round trips out
+// altogether, a busy socket is served by the one io_uring_enter() per iteration.
+
+using namespace reckoning;
+using namespace reckoning::event;
+using namespace reckoning::log;
+
+enum { RingEntries = 256 };
+
+// the provided buffers recvMultishot() receives into, shared by all of the loop's sockets
+// and only set up once someone asks for them
+enum { RecvBuffers = 64, RecvBufferSize = 16384, RecvGroup = 0 };
+
+// user_data for requests whose completions we don't care about
+static constexpr uint64_t IgnoreData = ~0ULL;
+// and for handing recv buffers to the kernel, those only matter if they fail
+static constexpr uint64_t ProvideData = ~1ULL;
+// set in the lower half of the user_data of completion based operations, that half is
+// the fd for polls which never gets this far
+static constexpr uint32_t OpFlag = 0x80000000;
+
+struct Loop::Ring
+{
+    ~Ring();
+
+    bool map(int fd, const io_uring_params& params);
+
+    // nullptr if the submission ring is full and the kernel won't take any of it
+    io_uring_sqe* get();
+    int enter(unsigned int minComplete, unsigned int flags, io_uring_getevents_arg* arg);
+
+    void pollAdd(int fd, uint32_t events, uint32_t generation);
+    void pollRemove(int fd, uint32_t generation);
+    // queues whatever didn't fit earlier, after poll() has drained the completions
+    void retryDeferred();
+
+    struct Op;
+    uint32_t addOp(int kind, int fd);
+    void submitOp(uint32_t index);
+    void cancel(uint64_t data);
+    void freeOp(uint32_t index);
+    // cancels everything still in flight and waits for the kernel to be done with it
+    void drain();
+
+    bool setupBuffers();
+    // hands a buffer (back) to the kernel
+    void provideBuffer(uint16_t id);
+    const uint8_t* buffer(uint16_t id) const { return bufferData.get() + static_cast<size_t>(id) * RecvBufferSize; }
+
+    static uint64_t userData(int fd, uint32_t generation)
+    {
+        return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+    }
+    static uint64_t opData(uint32_t index, uint32_t sequence)
+    {
+        return (static_cast<uint64_t>(sequence) << 32) | OpFlag | index;
+    }
+
+    int ringFd { -1 };
+
+    struct {
+        uint32_t* head { nullptr };
+        uint32_t* tail { nullptr };
+        uint32_t* array { nullptr };
+        uint32_t mask { 0 };
+        uint32_t entries { 0 };
+        io_uring_sqe* sqes { nullptr };
+    } sq;
+
+    struct {
+        uint32_t* head { nullptr };
+        uint32_t* tail { nullptr };
+        uint32_t mask { 0 };
+        io_uring_cqe* cqes { nullptr };
+    } cq;
+
+    void* sqMap { MAP_FAILED };
+    void* cqMap { MAP_FAILED };
+    size_t sqMapSize { 0 }, cqMapSize { 0 }, sqesSize { 0 };
+
+    // our copy of the submission tail, published to the kernel in enter()
+    uint32_t sqTail { 0 };
+    uint32_t pending { 0 };
+
+    // indexed by fd, the generation lets us tell completions for a previous
+    // registration of the same fd number apart from the current one
+    struct Poll
+    {
+        uint32_t generation { 0 };
+        uint32_t events { 0 };
+        bool active { false };
+        // Loop::FdFlag bits collected for the batch that's being dispatched
+        uint8_t ready { 0 };
+        // the fd's completion based operations, indexes into ops
+        std::vector<uint32_t> ops;
+    };
+    std::vector<Poll> polls;
+    // fds with ready bits, a multishot poll on a busy fd can complete many times
+    // per batch but its callback should only run once
+    std::vector<int> ready;
+
+    // requests that couldn't get a submission slot, retried by retryDeferred(). data is
+    // the index of an op to submit, the user_data of one to cancel or a buffer id
+    struct Deferred
+    {
+        enum Kind { PollAdd, PollRemove, OpSubmit, OpCancel, Provide };
+        Kind kind;
+        int fd;
+        uint32_t events;
+        uint32_t generation;
+        uint64_t data;
+    };
+    std::vector<Deferred> deferred;
+
+    // completion based operations, indexed by the lower half of their user_data. the
+    // upper half is the op's sequence number so that nothing meant for an op that's
+    // gone ever reaches whoever got its slot next
+    struct Op
+    {
+        enum Kind { Accept, Recv, Send };
+        Kind kind;
+        int fd;
+        uint32_t sequence;
+        // submitted or waiting to be, until a completion without IORING_CQE_F_MORE
+        bool inflight { false };
+        // the fd was removed, the kernel just has to let go of it
+        bool detached { false };
+        // stopRecv(), not to be taken up again
+        bool stopping { false };
+        AcceptCallback accept;
+        RecvCallback recv;
+        SendCallback send;
+        msghdr msg;
+        std::vector<iovec> iov;
+        std::shared_ptr<void> hold;
+    };
+    std::vector<std::unique_ptr<Op> > ops;
+    std::vector<uint32_t> freeOps;
+    uint32_t nextSequence { 0 };
+
+    // 0 until recvMultishot() first asks for them, -1 once the kernel turned them down
+    int bufferState { 0 };
+    std::unique_ptr<uint8_t[]> bufferData;
+};
+
+Loop::Ring::~Ring()
+{
+    if (sq.sqes != nullptr)
+        munmap(sq.sqes, sqesSize);
+    if (cqMap != MAP_FAILED && cqMap != sqMap)
+        munmap(cqMap, cqMapSize);
+    if (sqMap != MAP_FAILED)
+        munmap(sqMap, sqMapSize);
+}
+
+bool Loop::Ring::map(int fd, const io_uring_params& params)
+{
+    ringFd = fd;
+
+    sqMapSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+    }
+
+    sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqMap == MAP_FAILED)
+        return false;
+    if (single) {
+        cqMap = sqMap;
+    } else {
+        cqMap = mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqMap == MAP_FAILED)
+            return false;
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+
+    uint8_t* sqptr = static_cast<uint8_t*>(sqMap);
+    sq.head = reinterpret_cast<uint32_t*>(sqptr + params.sq_off.head);
+    sq.tail = reinterpret_cast<uint32_t*>(sqptr + params.sq_off.tail);
+    sq.array = reinterpret_cast<uint32_t*>(sqptr + params.sq_off.array);
+    sq.mask = *reinterpret_cast<uint32_t*>(sqptr + params.sq_off.ring_mask);
+    sq.entries = *reinterpret_cast<uint32_t*>(sqptr + params.sq_off.ring_entries);
+    sq.sqes = static_cast<io_uring_sqe*>(sqes);
+    sqTail = *sq.tail;
+
+    uint8_t* cqptr = static_cast<uint8_t*>(cqMap);
+    cq.head = reinterpret_cast<uint32_t*>(cqptr + params.cq_off.head);
+    cq.tail = reinterpret_cast<uint32_t*>(cqptr + params.cq_off.tail);
+    cq.mask = *reinterpret_cast<uint32_t*>(cqptr + params.cq_off.ring_mask);
+    cq.cqes = reinterpret_cast<io_uring_cqe*>(cqptr + params.cq_off.cqes);
+
+    return true;
+}
+
+io_uring_sqe* Loop::Ring::get()
+{
+    while (sqTail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE) >= sq.entries) {
+        // full, submit what we have so far. the kernel might take only part of it,
+        // or none at all with EBUSY until the completion ring has been drained
+        if (enter(0, 0, nullptr) <= 0 && sqTail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE) >= sq.entries)
+            return nullptr;
+    }
+    const uint32_t index = sqTail & sq.mask;
+    io_uring_sqe* sqe = &sq.sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sq.array[index] = index;
+    ++sqTail;
+    ++pending;
+    return sqe;
+}
+
+int Loop::Ring::enter(unsigned int minComplete, unsigned int flags, io_uring_getevents_arg* arg)
+{
+    __atomic_store_n(sq.tail, sqTail, __ATOMIC_RELEASE);
+    int e;
+    eintrwrap(e, syscall(__NR_io_uring_enter, ringFd, pending, minComplete, flags, arg, arg ? sizeof(io_uring_getevents_arg) : 0));
+    if (e > 0) {
+        pending -= std::min<uint32_t>(e, pending);
+    }
+    return e;
+}
+
+void Loop::Ring::pollAdd(int fd, uint32_t events, uint32_t generation)
+{
+    io_uring_sqe* sqe = get();
+    if (!sqe) {
+        deferred.push_back({ Deferred::PollAdd, fd, events, generation, 0 });
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = userData(fd, generation);
+}
+
+void Loop::Ring::pollRemove(int fd, uint32_t generation)
+{
+    io_uring_sqe* sqe = get();
+    if (!sqe) {
+        // an armed poll keeps its file open, this one has to go through eventually
+        deferred.push_back({ Deferred::PollRemove, fd, 0, generation, 0 });
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = userData(fd, generation);
+    sqe->user_data = IgnoreData;
+}
+
+void Loop::Ring::retryDeferred()
+{
+    if (deferred.empty())
+        return;
+    std::vector<Deferred> retry;
+    retry.swap(deferred);
+    for (size_t i = 0; i < retry.size(); ++i) {
+        const Deferred& op = retry[i];
+        switch (op.kind) {
+        case Deferred::PollAdd: {
+            // skip adds that have since been replaced or removed
+            const auto& poll = polls[op.fd];
+            if (!poll.active || poll.generation != op.generation)
+                continue;
+            pollAdd(op.fd, op.events, op.generation);
+            break; }
+        case Deferred::PollRemove:
+            pollRemove(op.fd, op.generation);
+            break;
+        case Deferred::OpSubmit:
+            if (ops[op.data]->detached) {
+                // never got to the kernel, nothing to wait for
+                freeOp(op.data);
+                continue;
+            }
+            submitOp(op.data);
+            break;
+        case Deferred::OpCancel:
+            cancel(op.data);
+            break;
+        case Deferred::Provide:
+            provideBuffer(op.data);
+            break;
+        }
+        if (!deferred.empty()) {
+            // still no room, keep the rest in order for next time
+            deferred.insert(deferred.end(), retry.begin() + i + 1, retry.end());
+            return;
+        }
+    }
+}
+
+uint32_t Loop::Ring::addOp(int kind, int fd)
+{
+    uint32_t index;
+    if (!freeOps.empty()) {
+        index = freeOps.back();
+        freeOps.pop_back();
+    } else {
+        index = ops.size();
+        ops.emplace_back();
+    }
+    ops[index] = std::make_unique<Op>();
+    Op& op = *ops[index];
+    op.kind = static_cast<Op::Kind>(kind);
+    op.fd = fd;
+    op.sequence = ++nextSequence;
+    polls[fd].ops.push_back(index);
+    return index;
+}
+
+void Loop::Ring::submitOp(uint32_t index)
+{
+    Op& op = *ops[index];
+    op.inflight = true;
+    // behind whatever is already waiting, a cancel must never overtake its op
+    io_uring_sqe* sqe = deferred.empty() ? get() : nullptr;
+    if (!sqe) {
+        deferred.push_back({ Deferred::OpSubmit, op.fd, 0, 0, index });
+        return;
+    }
+    sqe->fd = op.fd;
+    switch (op.kind) {
+    case Op::Accept:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        break;
+    case Op::Recv:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RecvGroup;
+        break;
+    case Op::Send:
+        // MSG_WAITALL has the kernel carry on after a short send instead of completing
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = reinterpret_cast<uint64_t>(&op.msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        break;
+    }
+    sqe->user_data = opData(index, op.sequence);
+}
+
+void Loop::Ring::cancel(uint64_t data)
+{
+    io_uring_sqe* sqe = deferred.empty() ? get() : nullptr;
+    if (!sqe) {
+        deferred.push_back({ Deferred::OpCancel, -1, 0, 0, data });
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = IgnoreData;
+}
+
+void Loop::Ring::freeOp(uint32_t index)
+{
+    // callbacks and holds might call back into the loop when they go
+    std::unique_ptr<Op> op = std::move(ops[index]);
+    freeOps.push_back(index);
+    if (!op->detached) {
+        auto& list = polls[op->fd].ops;
+        list.erase(std::find(list.begin(), list.end(), index));
+    }
+}
+
+void Loop::Ring::drain()
+{
+    auto inflight = [this]() {
+        return std::count_if(ops.begin(), ops.end(), [](const std::unique_ptr<Op>& op) {
+            return op && op->inflight;
+        });
+    };
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (!ops[i])
+            continue;
+        // ones that never made it to the kernel are dropped by retryDeferred()
+        ops[i]->detached = true;
+        if (ops[i]->inflight)
+            cancel(opData(i, ops[i]->sequence));
+    }
+    // don't hang on to a loop that's going away for long, a second is plenty for
+    // cancels to go through
+    for (int tries = 0; tries < 100 && inflight(); ++tries) {
+        __kernel_timespec ts = { 0, 10000000 };
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+
+        uint32_t head = *cq.head;
+        const uint32_t tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cq.cqes[head & cq.mask];
+            if (cqe.user_data == IgnoreData || cqe.user_data == ProvideData || !(static_cast<uint32_t>(cqe.user_data) & OpFlag))
+                continue;
+            const uint32_t index = static_cast<uint32_t>(cqe.user_data) & ~OpFlag;
+            if (index >= ops.size() || !ops[index] || ops[index]->sequence != cqe.user_data >> 32)
+                continue;
+            if (ops[index]->kind == Op::Accept && cqe.res >= 0) {
+                int e;
+                eintrwrap(e, ::close(cqe.res));
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                ops[index]->inflight = false;
+        }
+        __atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+        retryDeferred();
+    }
+}
+
+bool Loop::Ring::setupBuffers()
+{
+    if (bufferState)
+        return bufferState > 0;
+    bufferState = 1;
+    bufferData.reset(new uint8_t[RecvBuffers * RecvBufferSize]);
+    for (uint16_t id = 0; id < RecvBuffers; ++id) {
+        provideBuffer(id);
+    }
+    return true;
+}
+
+void Loop::Ring::provideBuffer(uint16_t id)
+{
+    // one at a time as they come back. the SQEs go out with the next enter, ahead of
+    // any recv that's taken up again after running out. registered buffer rings would
+    // save those but aren't anywhere near as widely usable
+    io_uring_sqe* sqe = deferred.empty() ? get() : nullptr;
+    if (!sqe) {
+        deferred.push_back({ Deferred::Provide, -1, 0, 0, id });
+        return;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer(id));
+    sqe->len = RecvBufferSize;
+    sqe->off = id;
+    sqe->buf_group = RecvGroup;
+    sqe->user_data = ProvideData;
+}
+
+void Loop::init()
+{
+    tLoop = shared_from_this();
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    mFd = syscall(__NR_io_uring_setup, RingEntries, &params);
+    if (mFd == -1) {
+        Log(Log::Error) << "unable to open eventloop io_uring_setup" << errno;
+        cleanup();
+        return;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        Log(Log::Error) << "io_uring is missing IORING_FEAT_EXT_ARG, kernel too old";
+        cleanup();
+        return;
+    }
+
+    mRing = new Ring;
+    if (!mRing->map(mFd, params)) {
+        Log(Log::Error) << "unable to map io_uring" << errno;
+        delete mRing;
+        mRing = nullptr;
+        cleanup();
+        return;
+    }
+
+    commonInit();
+
+    if (mWakeup[0] != -1) {
+        registerFd(mWakeup[0], FdRead);
+    }
+}
+
+void Loop::deinit()
+{
+    // the kernel could still be receiving into our buffers or sending from what the
+    // sockets gave us
+    if (mRing)
+        mRing->drain();
+    delete mRing;
+    mRing = nullptr;
+}
+
+// FdEdgeWrite never gets here, see FdEntry::interest()
+static inline uint32_t pollEvents(uint8_t flags)
+{
+    // nothing asked for, nothing polled. fds that do their I/O through the ring
+    if (!(flags & (Loop::FdRead | Loop::FdWrite)))
+        return 0;
+    uint32_t events = POLLRDHUP;
+    if (flags & Loop::FdRead)
+        events |= POLLIN;
+    if (flags & Loop::FdWrite)
+        events |= POLLOUT;
+    return events;
+}
+
+void Loop::registerFd(int fd, uint8_t flags)
+{
+    if (static_cast<size_t>(fd) >= mRing->polls.size()) {
+        mRing->polls.resize(fd + 1);
+    }
+    auto& poll = mRing->polls[fd];
+    if (poll.active && poll.events) {
+        mRing->pollRemove(fd, poll.generation);
+    }
+    ++poll.generation;
+    poll.events = pollEvents(flags);
+    poll.active = true;
+    if (poll.events)
+        mRing->pollAdd(fd, poll.events, poll.generation);
+}
+
+void Loop::modifyFd(int fd, uint8_t flags)
+{
+    if (static_cast<size_t>(fd) >= mRing->polls.size())
+        return;
+    auto& poll = mRing->polls[fd];
+    if (!poll.active)
+        return;
+    const uint32_t events = pollEvents(flags);
+    if (poll.events)
+        mRing->pollRemove(fd, poll.generation);
+    ++poll.generation;
+    poll.events = events;
+    if (poll.events)
+        mRing->pollAdd(fd, poll.events, poll.generation);
+}
+
+void Loop::unregisterFd(int fd)
+{
+    if (static_cast<size_t>(fd) >= mRing->polls.size())
+        return;
+    auto& poll = mRing->polls[fd];
+    if (!poll.active)
+        return;
+    if (poll.events)
+        mRing->pollRemove(fd, poll.generation);
+    ++poll.generation;
+    poll.active = false;
+    // whatever the fd still has going is cancelled, its callbacks aren't called anymore
+    for (uint32_t index : poll.ops) {
+        Ring::Op& op = *mRing->ops[index];
+        op.detached = true;
+        if (op.inflight)
+            mRing->cancel(Ring::opData(index, op.sequence));
+    }
+    poll.ops.clear();
+}
+
+bool Loop::acceptMultishot(int fd, AcceptCallback&& callback)
+{
+    assert(isLoopThread());
+    if (!mRing || fd < 0 || static_cast<size_t>(fd) >= mRing->polls.size() || !mRing->polls[fd].active)
+        return false;
+    const uint32_t index = mRing->addOp(Ring::Op::Accept, fd);
+    mRing->ops[index]->accept = std::move(callback);
+    mRing->submitOp(index);
+    return true;
+}
+
+bool Loop::recvMultishot(int fd, RecvCallback&& callback)
+{
+    assert(isLoopThread());
+    if (!mRing || fd < 0 || static_cast<size_t>(fd) >= mRing->polls.size() || !mRing->polls[fd].active)
+        return false;
+    if (!mRing->setupBuffers())
+        return false;
+    const uint32_t index = mRing->addOp(Ring::Op::Recv, fd);
+    mRing->ops[index]->recv = std::move(callback);
+    mRing->submitOp(index);
+    return true;
+}
+
+void Loop::stopRecv(int fd)
+{
+    assert(isLoopThread());
+    if (!mRing || fd < 0 || static_cast<size_t>(fd) >= mRing->polls.size())
+        return;
+    for (uint32_t index : mRing->polls[fd].ops) {
+        Ring::Op& op = *mRing->ops[index];
+        if (op.kind == Ring::Op::Recv && !op.stopping) {
+            op.stopping = true;
+            mRing->cancel(Ring::opData(index, op.sequence));
+        }
+    }
+}
+
+bool Loop::sendv(int fd, const iovec* iov, int count, std::shared_ptr<void>&& hold, SendCallback&& callback)
+{
+    assert(isLoopThread());
+    if (!mRing || fd < 0 || static_cast<size_t>(fd) >= mRing->polls.size() || !mRing->polls[fd].active)
+        return false;
+    const uint32_t index = mRing->addOp(Ring::Op::Send, fd);
+    Ring::Op& op = *mRing->ops[index];
+    op.iov.assign(iov, iov + count);
+    memset(&op.msg, 0, sizeof(op.msg));
+    op.msg.msg_iov = op.iov.data();
+    op.msg.msg_iovlen = op.iov.size();
+    op.hold = std::move(hold);
+    op.send = std::move(callback);
+    mRing->submitOp(index);
+    return true;
+}
+
+bool Loop::completeOp(uint32_t index, int res, uint32_t flags)
+{
+    Ring::Op* op = mRing->ops[index].get();
+    const uint8_t* data = nullptr;
+    int buffer = -1;
+    if (flags & IORING_CQE_F_BUFFER) {
+        buffer = flags >> IORING_CQE_BUFFER_SHIFT;
+        data = mRing->buffer(buffer);
+    }
+
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more && !op->detached && !op->stopping
+        && ((op->kind == Ring::Op::Accept && res >= 0)
+            || (op->kind == Ring::Op::Recv && (res > 0 || (res == -ENOBUFS && mRing->bufferState > 0))))) {
+        // the kernel ends a multishot by itself now and then, when the completion ring
+        // overflows or it ran out of buffers. those are taken up again, the buffers are
+        // back by the time it's submitted
+        mRing->submitOp(index);
+        more = true;
+    }
+    if (!more)
+        op->inflight = false;
+
+    bool ran = false;
+    if (op->detached) {
+        // nobody to hand it to
+        if (op->kind == Ring::Op::Accept && res >= 0) {
+            int e;
+            eintrwrap(e, ::close(res));
+        }
+    } else if (res != -ENOBUFS || !more) {
+        ran = true;
+        ++mFdDispatches;
+        switch (op->kind) {
+        case Ring::Op::Accept:
+            beginDispatch(DispatchFd, op->accept.target_type(), op->fd);
+            op->accept(res);
+            break;
+        case Ring::Op::Recv:
+            beginDispatch(DispatchFd, op->recv.target_type(), op->fd);
+            // out of buffers while stopping ends it just as well as the cancel would have
+            op->recv(res == -ENOBUFS && op->stopping ? -ECANCELED : res, data);
+            // stopped on a chunk rather than on the cancel, it still needs its end
+            if (!more && res > 0 && !op->detached)
+                op->recv(-ECANCELED, nullptr);
+            break;
+        case Ring::Op::Send:
+            beginDispatch(DispatchFd, op->send.target_type(), op->fd);
+            op->send(res);
+            break;
+        }
+        endDispatch();
+    }
+
+    if (buffer >= 0)
+        mRing->provideBuffer(buffer);
+    if (!op->inflight)
+        mRing->freeOp(index);
+    return ran;
+}
+
+void Loop::flushFds()
+{
+    // normally these go along with the next poll(), a host waiting on the ring
+    // needs them in place first
+    if (mRing->pending)
+        mRing->enter(0, 0, nullptr);
+}
+
+int Loop::poll(std::chrono::nanoseconds timeout)
+{
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    __kernel_timespec ts;
+    if (timeout >= std::chrono::nanoseconds{0}) {
+        const auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+        ts.tv_sec = secs.count();
+        ts.tv_nsec = (timeout - secs).count();
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+
+    // submit all queued registration changes and wait, in one go. if we already
+    // have completions waiting there's no need to wait for more
+    const bool ready = *mRing->cq.head != __atomic_load_n(mRing->cq.tail, __ATOMIC_ACQUIRE);
+    int e;
+    if (ready || timeout == std::chrono::nanoseconds{0}) {
+        // not waiting at all, skip setting up a timeout. GETEVENTS still gets any
+        // completions that are due flushed into the ring
+        e = mRing->enter(0, IORING_ENTER_GETEVENTS, nullptr);
+    } else {
+        e = mRing->enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+    }
+    if (e < 0 && errno != ETIME && errno != EBUSY) {
+        return -1;
+    }
+
+    // only take what's there now, a busy fd keeps producing completions while we
+    // dispatch and would otherwise keep us from ever getting back to the timers
+    int count = 0;
+    uint32_t head = *mRing->cq.head;
+    const uint32_t tail = __atomic_load_n(mRing->cq.tail, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (head == tail)
+            break;
+        const io_uring_cqe cqe = mRing->cq.cqes[head & mRing->cq.mask];
+        ++head;
+        __atomic_store_n(mRing->cq.head, head, __ATOMIC_RELEASE);
+
+        if (cqe.user_data == IgnoreData)
+            continue;
+        if (cqe.user_data == ProvideData) {
+            if (cqe.res < 0 && mRing->bufferState > 0) {
+                // recvs that run out now end with -ENOBUFS instead of being taken up again
+                Log(Log::Error) << "unable to provide io_uring buffers" << -cqe.res;
+                mRing->bufferState = -1;
+            }
+            continue;
+        }
+
+        if (static_cast<uint32_t>(cqe.user_data) & OpFlag) {
+            const uint32_t index = static_cast<uint32_t>(cqe.user_data) & ~OpFlag;
+            const auto& ops = mRing->ops;
+            if (index < ops.size() && ops[index] && ops[index]->sequence == cqe.user_data >> 32
+                && completeOp(index, cqe.res, cqe.flags)) {
+                ++count;
+            }
+            continue;
+        }
+
+        const int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+        const uint32_t generation = cqe.user_data >> 32;
+        if (static_cast<size_t>(fd) >= mRing->polls.size())
+            continue;
+        auto& poll = mRing->polls[fd];
+        if (!poll.active || poll.generation != generation) {
+            // completion for an old registration
+            continue;
+        }
+        ++count;
+        uint8_t flags = 0;
+        if (cqe.res < 0 && cqe.res != -ECANCELED) {
+            Log(Log::Warn) << "poll error on fd" << fd << -cqe.res;
+            unregisterFd(fd);
+            flags = FdError;
+        } else {
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                // the kernel dropped our multishot request (cq overflow for instance), rearm
+                mRing->pollAdd(fd, poll.events, poll.generation);
+            }
+            if (cqe.res < 0)
+                continue;
+
+            const uint32_t ev = cqe.res;
+            if (ev & (POLLERR | POLLHUP) && !(ev & POLLRDHUP)) {
+                // badness, we want this thing out
+                unregisterFd(fd);
+                flags = FdError;
+            } else {
+                if (ev & (POLLIN | POLLRDHUP)) {
+                    // read event
+                    if (fd == mWakeup[0]) {
+                        readWakeup();
+                    } else {
+                        flags |= FdRead;
+                    }
+                }
+                if (ev & POLLOUT) {
+                    // write event
+                    flags |= FdWrite;
+                }
+            }
+        }
+        if (!flags)
+            continue;
+        if (!poll.ready)
+            mRing->ready.push_back(fd);
+        poll.ready |= flags;
+    }
+
+    // with the completions drained the kernel has room for what it turned away
+    mRing->retryDeferred();
+
+    // callbacks can add fds and grow polls, so no references across them
+    for (size_t i = 0; i < mRing->ready.size(); ++i) {
+        const int fd = mRing->ready[i];
+        const uint8_t flags = mRing->polls[fd].ready;
+        mRing->polls[fd].ready = 0;
+        if (flags & FdError) {
+            processFd(fd, FdError);
+            continue;
+        }
+        if (flags & FdRead)
+            processFd(fd, FdRead);
+        if (flags & FdWrite)
+            processFd(fd, FdWrite);
+    }
+    mRing->ready.clear();
+    return count;
+}
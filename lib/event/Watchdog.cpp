@@ -0,0 +1,281 @@
+#include <event/Watchdog.h>
+#include <log/Log.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cxxabi.h>
+#include "config.h"
+#ifdef HAVE_BACKTRACE
+#include <execinfo.h>
+#include <signal.h>
+#endif
+
+using namespace reckoning;
+using namespace reckoning::event;
+using namespace reckoning::log;
+
+#ifdef HAVE_BACKTRACE
+// one sample at a time for the whole process, the handler only ever touches these.
+// the state goes Idle -> Requested -> Writing -> Done -> Idle, a sampler that gives up
+// waiting takes it from Requested straight back to Idle so that a late signal is ignored
+enum SampleState { SampleIdle, SampleRequested, SampleWriting, SampleDone };
+enum { MaxFrames = 64 };
+
+static std::mutex sSampleMutex;
+static std::atomic<int> sSampleState(SampleIdle);
+static void* sSampleFrames[MaxFrames];
+static int sSampleCount = 0;
+
+static void sampleHandler(int)
+{
+    int expected = SampleRequested;
+    if (!sSampleState.compare_exchange_strong(expected, SampleWriting))
+        return;
+    sSampleCount = backtrace(sSampleFrames, MaxFrames);
+    sSampleState.store(SampleDone);
+}
+
+static bool installSampleHandler()
+{
+    // the first backtrace() loads libgcc which isn't something to do in a signal handler
+    void* frame;
+    backtrace(&frame, 1);
+
+    struct sigaction action = {};
+    action.sa_handler = sampleHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(Watchdog::SampleSignal, &action, nullptr) != 0) {
+        Log(Log::Error) << "unable to install stack sample handler" << errno;
+        return false;
+    }
+    return true;
+}
+#endif
+
+static std::string demangle(const char* name)
+{
+    int status;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (!demangled)
+        return name;
+    std::string result = demangled;
+    free(demangled);
+    return result;
+}
+
+Watchdog::Watchdog()
+    : mStopped(false)
+{
+}
+
+Watchdog::~Watchdog()
+{
+    stop();
+}
+
+void Watchdog::init()
+{
+    mThread = std::thread(&Watchdog::run, this);
+}
+
+void Watchdog::watch(const std::shared_ptr<Loop>& loop, std::chrono::milliseconds threshold, uint8_t flags)
+{
+    assert(loop && threshold > std::chrono::milliseconds{0});
+    {
+        std::lock_guard<std::mutex> locker(mMutex);
+        auto it = std::find_if(mWatched.begin(), mWatched.end(), [&loop](const Watched& watched) {
+            return watched.key == loop.get();
+        });
+        if (it != mWatched.end()) {
+            it->threshold = threshold;
+            it->flags = flags;
+        } else {
+            mWatched.push_back({ loop, loop.get(), threshold, flags, 0 });
+            loop->mWatchers.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    // the check interval might have gotten shorter
+    mCond.notify_one();
+}
+
+void Watchdog::unwatch(const std::shared_ptr<Loop>& loop)
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    auto it = std::find_if(mWatched.begin(), mWatched.end(), [&loop](const Watched& watched) {
+        return watched.key == loop.get();
+    });
+    if (it == mWatched.end())
+        return;
+    loop->mWatchers.fetch_sub(1, std::memory_order_relaxed);
+    mWatched.erase(it);
+}
+
+void Watchdog::stop()
+{
+    {
+        std::lock_guard<std::mutex> locker(mMutex);
+        mStopped = true;
+        for (const auto& watched : mWatched) {
+            if (auto loop = watched.loop.lock())
+                loop->mWatchers.fetch_sub(1, std::memory_order_relaxed);
+        }
+        mWatched.clear();
+    }
+    mCond.notify_one();
+    if (mThread.joinable())
+        mThread.join();
+}
+
+std::chrono::nanoseconds Watchdog::interval() const
+{
+    // a few looks per threshold so that stalls are caught reasonably close to it
+    if (mWatched.empty())
+        return std::chrono::seconds{1};
+    std::chrono::nanoseconds shortest = mWatched.front().threshold;
+    for (const auto& watched : mWatched) {
+        shortest = std::min(shortest, watched.threshold);
+    }
+    return std::max<std::chrono::nanoseconds>(shortest / 4, std::chrono::milliseconds{1});
+}
+
+void Watchdog::run()
+{
+    std::vector<Watched> checking;
+    std::unique_lock<std::mutex> locker(mMutex);
+    while (!mStopped) {
+        mCond.wait_for(locker, interval());
+        if (mStopped)
+            break;
+        // checks log and can sit in sampleStack() for a while, watch() and unwatch()
+        // shouldn't have to wait for that
+        checking = mWatched;
+        locker.unlock();
+        for (auto& watched : checking) {
+            check(watched);
+        }
+        locker.lock();
+        // only we change reported, put it back on whatever is still being watched
+        for (const auto& checked : checking) {
+            auto it = std::find_if(mWatched.begin(), mWatched.end(), [&checked](const Watched& watched) {
+                return watched.key == checked.key;
+            });
+            if (it != mWatched.end())
+                it->reported = checked.reported;
+        }
+    }
+}
+
+void Watchdog::check(Watched& watched)
+{
+    auto loop = watched.loop.lock();
+    if (!loop)
+        return;
+
+    // each stretch of being awake is reported once, by the time it started
+    const int64_t awake = loop->mAwakeSince.load(std::memory_order_acquire);
+    if (awake != watched.reported && watched.reported != 0) {
+        const auto lasted = std::chrono::nanoseconds{steadyNanoseconds() - watched.reported};
+        Log(Log::Info) << "loop stall over, lasted at most"
+                       << std::chrono::duration_cast<std::chrono::milliseconds>(lasted).count() << "ms";
+        watched.reported = 0;
+    }
+    if (!awake || awake == watched.reported)
+        return;
+
+    const Loop::Dispatch dispatch = loop->dispatch();
+    if (dispatch.awake < watched.threshold)
+        return;
+    watched.reported = awake;
+
+    // sample first, the loop thread might get going again while we log
+    std::vector<std::string> stack;
+    if (watched.flags & StackSample)
+        stack = sampleStack(loop->mPthread);
+
+    Log(Log::Warn) << "loop stalled for"
+                   << std::chrono::duration_cast<std::chrono::milliseconds>(dispatch.awake).count() << "ms"
+                   << describe(dispatch);
+    for (size_t i = 0; i < stack.size(); ++i) {
+        Log(Log::Warn) << "    #" + std::to_string(i) << stack[i];
+    }
+}
+
+std::string Watchdog::describe(const Loop::Dispatch& dispatch)
+{
+    const char* kind = nullptr;
+    switch (dispatch.kind) {
+    case Loop::DispatchNone:
+        return "outside of any callback";
+    case Loop::DispatchEvent:
+        kind = "event";
+        break;
+    case Loop::DispatchTimer:
+        kind = "timer";
+        break;
+    case Loop::DispatchFd:
+        kind = "fd";
+        break;
+    case Loop::DispatchHook:
+        kind = "hook";
+        break;
+    }
+    std::string what = std::string("in ") + kind;
+    if (dispatch.kind == Loop::DispatchFd)
+        what += " " + std::to_string(dispatch.fd);
+    what += " " + (dispatch.type ? demangle(dispatch.type->name()) : std::string("<unknown>"));
+    what += " for " + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(dispatch.running).count()) + "ms";
+    return what;
+}
+
+std::vector<std::string> Watchdog::sampleStack(pthread_t thread)
+{
+    std::vector<std::string> stack;
+#ifdef HAVE_BACKTRACE
+    static const bool installed = installSampleHandler();
+    if (!installed)
+        return stack;
+
+    std::lock_guard<std::mutex> locker(sSampleMutex);
+    sSampleState.store(SampleRequested);
+    if (pthread_kill(thread, SampleSignal) != 0) {
+        sSampleState.store(SampleIdle);
+        return stack;
+    }
+
+    // a thread that's blocked with the signal masked never answers
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{100};
+    while (sSampleState.load() != SampleDone) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            int expected = SampleRequested;
+            if (sSampleState.compare_exchange_strong(expected, SampleIdle)) {
+                Log(Log::Warn) << "loop thread didn't answer the stack sample signal";
+                return stack;
+            }
+            // it's writing the sample as we speak
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds{100});
+    }
+
+    char** symbols = backtrace_symbols(sSampleFrames, sSampleCount);
+    if (symbols) {
+        // the first two are the handler and the signal trampoline
+        for (int i = 2; i < sSampleCount; ++i) {
+            // module(mangled+offset) [address], demangle what's inside the parens
+            std::string frame = symbols[i];
+            const size_t open = frame.find('(');
+            const size_t plus = frame.find('+', open);
+            if (open != std::string::npos && plus != std::string::npos && plus > open + 1) {
+                const std::string name = frame.substr(open + 1, plus - open - 1);
+                frame.replace(open + 1, name.size(), demangle(name.c_str()));
+            }
+            stack.push_back(std::move(frame));
+        }
+        free(symbols);
+    }
+    sSampleState.store(SampleIdle);
+#else
+    (void)thread;
+#endif
+    return stack;
+}
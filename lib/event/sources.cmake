@@ -1,7 +1,9 @@
-set(EVENT_SOURCES Loop.cpp)
+set(EVENT_SOURCES Executor.cpp Loop.cpp LoopGroup.cpp Watchdog.cpp)
 
 if (HAVE_KQUEUE)
     list(APPEND EVENT_SOURCES Loop_kqueue.cpp)
+elseif (HAVE_IO_URING)
+    list(APPEND EVENT_SOURCES Loop_uring.cpp)
 elseif (HAVE_EPOLL)
     list(APPEND EVENT_SOURCES Loop_epoll.cpp)
 endif()
@@ -197,46 +197,27 @@ static inline Decoder::Image decodeJPEG(const std::shared_ptr<buffer::Buffer>& d
 
 Decoder::Decoder()
 {
-    mThread = std::thread([&]() {
-        for (;;) {
-            std::vector<std::shared_ptr<Job > > jobs;
-            {
-                std::unique_lock<std::mutex> locker(mMutex);
-                while (mJobs.empty() && !mStopped) {
-                    mCond.wait(locker);
-                }
-                jobs = std::move(mJobs);
-                if (mStopped)
-                    return;
-            }
-            for (const auto& job : jobs) {
-                const auto& buf = job->data;
-                switch (guessFormat(buf)) {
-                case Format_JPEG:
-                    job->then.resolve(decodeJPEG(buf, job->pitchMultiple));
-                    break;
-                case Format_PNG:
-                    job->then.resolve(decodePNG(buf, job->pitchMultiple));
-                    break;
-                case Format_WEBP:
-                    job->then.resolve(decodeWEBP(buf, job->pitchMultiple));
-                    break;
-                default:
-                    job->then.resolve({});
-                    break;
-                }
-            }
-        }
-    });
 }
 
 Decoder::~Decoder()
 {
-    {
-        std::unique_lock<std::mutex> locker(mMutex);
-        mStopped = true;
-        mCond.notify_one();
-    }
+}
 
-    mThread.join();
+void Decoder::run(const std::shared_ptr<Job>& job)
+{
+    const auto& buf = job->data;
+    switch (guessFormat(buf)) {
+    case Format_JPEG:
+        job->then.resolve(decodeJPEG(buf, job->pitchMultiple));
+        break;
+    case Format_PNG:
+        job->then.resolve(decodePNG(buf, job->pitchMultiple));
+        break;
+    case Format_WEBP:
+        job->then.resolve(decodeWEBP(buf, job->pitchMultiple));
+        break;
+    default:
+        job->then.resolve({});
+        break;
+    }
 }
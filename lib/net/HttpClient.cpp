@@ -7,6 +7,7 @@
 #include <util/Socket.h>
 #include <curl/curl.h>
 #include <stdlib.h>
+#include <memory_resource>
 #include <regex>
 
 using namespace reckoning;
@@ -119,8 +120,12 @@ void HttpClient::connect(const std::string& url, const Headers& headers, uint8_t
     conn->url = url;
     conn->http = shared_from_this();
     if (!headers.empty()) {
+        // curl copies these, they can live in the loop's arena
+        std::pmr::string header(event::Loop::threadArena());
         for (const auto& h : headers) {
-            const std::string header = h.first + ": " + h.second;
+            header.assign(h.first);
+            header += ": ";
+            header += h.second;
             conn->outHeaders = curl_slist_append(conn->outHeaders, header.c_str());
         }
         curl_easy_setopt(conn->easy, CURLOPT_HTTPHEADER, conn->outHeaders);
@@ -274,7 +279,8 @@ size_t HttpClient::easyWriteCallback(void *ptr, size_t size, size_t nmemb, void
 
 size_t HttpClient::easyHeaderCallback(char *buffer, size_t size, size_t nmemb, void *userdata)
 {
-    const std::string header(buffer, size * nmemb);
+    // only the key and value are kept, the line itself can live in the loop's arena
+    const std::pmr::string header(buffer, size * nmemb, event::Loop::threadArena());
 
     auto trim = [&header]() {
         size_t n = header.size();
@@ -289,7 +295,7 @@ size_t HttpClient::easyHeaderCallback(char *buffer, size_t size, size_t nmemb, v
     if (conn->headers.empty() && conn->status == 0) {
         // assume HTTP line?
         std::regex headerrx("^HTTP\\/\\d(\\.\\d)? (\\d{3}) ([a-zA-Z0-9]*)");
-        std::smatch match;
+        std::match_results<std::pmr::string::const_iterator> match;
         if (regex_search(header, match, headerrx) == true && match.size() == 4) {
             conn->status = atoi(match.str(2).c_str());
             conn->reason = match.str(3);
@@ -325,10 +331,10 @@ size_t HttpClient::easyHeaderCallback(char *buffer, size_t size, size_t nmemb, v
             }
         }
         assert(nsize >= split + 2);
-        std::string headerKey = header.substr(0, split);
+        std::string headerKey(header.data(), split);
         std::transform(headerKey.begin(), headerKey.end(), headerKey.begin(),
                        [](unsigned char c){ return std::tolower(c); });
-        conn->headers.add(std::move(headerKey), header.substr(split + 2, nsize - (split + 2)));
+        conn->headers.add(std::move(headerKey), std::string(header.data() + split + 2, nsize - (split + 2)));
     }
 
     return size * nmemb;
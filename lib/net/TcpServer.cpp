@@ -2,6 +2,7 @@
 #include "config.h"
 #include <util/Socket.h>
 #include <log/Log.h>
+#include <cerrno>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -9,39 +10,55 @@ using namespace reckoning;
 using namespace reckoning::net;
 using namespace reckoning::log;
 
-static inline int listenHelper(struct sockaddr* address, socklen_t len, int backlog)
+// logs what failed and closes fd, errno is left as the failing call set it
+static inline int listenFailed(int fd, const char* what)
+{
+    const int error = errno;
+    Log(Log::Error) << "TcpServer" << what << "failed" << error;
+    if (fd != -1)
+        close(fd);
+    errno = error;
+    return -1;
+}
+
+static inline int listenHelper(struct sockaddr* address, socklen_t len, int backlog, unsigned int serverFlags)
 {
     int fd = socket((len == sizeof(sockaddr_in) ? AF_INET : AF_INET6), SOCK_STREAM, 0);
     if (fd == -1)
-        return -1;
+        return listenFailed(fd, "socket");
 #ifdef HAVE_NONBLOCK
     util::socket::setFlag(fd, O_NONBLOCK);
 #endif
     int flags = 1, e;
 #ifdef HAVE_NOSIGPIPE
     e = ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
-    if (e == -1) {
-        close(fd);
-        return -1;
-    }
+    if (e == -1)
+        return listenFailed(fd, "SO_NOSIGPIPE");
 #endif
     // nodelay
     flags = 1;
     e = ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&flags, sizeof(int));
-    if (e == -1) {
+    if (e == -1)
+        return listenFailed(fd, "SO_REUSEADDR");
+    if (serverFlags & TcpServer::ReusePort) {
+#ifdef HAVE_REUSEPORT
+        // without it each server binds on its own and all but the first fail
+        e = ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&flags, sizeof(int));
+        if (e == -1)
+            return listenFailed(fd, "SO_REUSEPORT");
+#else
+        Log(Log::Error) << "TcpServer SO_REUSEPORT not supported";
         close(fd);
+        errno = ENOPROTOOPT;
         return -1;
+#endif
     }
     e = bind(fd, address, len);
-    if (e == -1) {
-        close(fd);
-        return -1;
-    }
+    if (e == -1)
+        return listenFailed(fd, "bind");
     e = listen(fd, backlog);
-    if (e == -1) {
-        close(fd);
-        return -1;
-    }
+    if (e == -1)
+        return listenFailed(fd, "listen");
     return fd;
 }
 
@@ -60,7 +77,12 @@ void TcpServer::socketCallback(int fd, uint8_t flags)
     }
     int e;
     for (;;) {
+#ifdef HAVE_ACCEPT4
+        // accepted sockets don't inherit O_NONBLOCK from the listener on all platforms
+        eintrwrap(e, ::accept4(fd, &client, &size, SOCK_NONBLOCK | SOCK_CLOEXEC));
+#else
         eintrwrap(e, ::accept(fd, &client, &size));
+#endif
         if (e == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return;
@@ -71,13 +93,61 @@ void TcpServer::socketCallback(int fd, uint8_t flags)
             mError.emit();
             return;
         }
-        // we have our accepted client
-        auto socket = TcpSocket::create();
-        socket->setSocket(e, mIsIPv6);
-        mConnection.emit(std::move(socket));
+#if !defined(HAVE_ACCEPT4) && defined(HAVE_NONBLOCK)
+        util::socket::setFlag(e, O_NONBLOCK);
+#endif
+        accepted(e);
     }
 }
 
+void TcpServer::accepted(int fd)
+{
+    // we have our accepted client
+    auto socket = TcpSocket::create();
+    socket->setSocket(fd, mIsIPv6);
+    mConnection.emit(std::move(socket));
+}
+
+#if defined(HAVE_IO_URING)
+void TcpServer::acceptCompleted(int result)
+{
+    if (result >= 0) {
+        accepted(result);
+        return;
+    }
+    if (result == -EINVAL) {
+        // no multishot accept in this kernel, back to waiting for readiness
+        if (auto loop = event::Loop::loop()) {
+            loop->updateFd(mFd, event::Loop::FdRead);
+            loop->retryFd(mFd, event::Loop::FdRead);
+        }
+        return;
+    }
+    // bad
+    Log(Log::Error) << "TcpServer failed to accept" << -result;
+    close();
+    mError.emit();
+}
+#endif
+
+bool TcpServer::listen(sockaddr* address, socklen_t len, bool ipv6)
+{
+    // errno tells the caller why when this fails
+    mFd = listenHelper(address, len, 10, mFlags);
+    if (mFd == -1)
+        return false;
+    mIsIPv6 = ipv6;
+    auto loop = event::Loop::loop();
+    mFdHandle = loop->addFd(mFd, event::Loop::FdRead,
+                            std::bind(&TcpServer::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
+#if defined(HAVE_IO_URING)
+    // let the ring do the accepting, no readiness needed then
+    if (loop->acceptMultishot(mFd, std::bind(&TcpServer::acceptCompleted, this, std::placeholders::_1)))
+        loop->updateFd(mFd, 0);
+#endif
+    return true;
+}
+
 bool TcpServer::listen(uint16_t port)
 {
     sockaddr_in addr;
@@ -85,15 +155,7 @@ bool TcpServer::listen(uint16_t port)
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(port);
-    mFd = listenHelper(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), 10);
-    if (mFd == -1) {
-        Log(Log::Error) << "TcpServer failed to listen";
-        return false;
-    }
-    mIsIPv6 = false;
-    mFdHandle = event::Loop::loop()->addFd(mFd, event::Loop::FdRead,
-                                           std::bind(&TcpServer::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
-    return true;
+    return listen(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), false);
 }
 
 bool TcpServer::listen(const IPv4& ip, uint16_t port)
@@ -103,15 +165,7 @@ bool TcpServer::listen(const IPv4& ip, uint16_t port)
     addr.sin_family = AF_INET;
     addr.sin_addr = ip.ip();
     addr.sin_port = htons(port);
-    mFd = listenHelper(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), 10);
-    if (mFd == -1) {
-        Log(Log::Error) << "TcpServer failed to listen";
-        return false;
-    }
-    mIsIPv6 = false;
-    mFdHandle = event::Loop::loop()->addFd(mFd, event::Loop::FdRead,
-                                           std::bind(&TcpServer::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
-    return true;
+    return listen(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), false);
 }
 
 bool TcpServer::listen(const IPv6& ip, uint16_t port)
@@ -121,15 +175,7 @@ bool TcpServer::listen(const IPv6& ip, uint16_t port)
     addr.sin6_family = AF_INET;
     addr.sin6_addr = ip.ip();
     addr.sin6_port = htons(port);
-    mFd = listenHelper(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), 10);
-    if (mFd == -1) {
-        Log(Log::Error) << "TcpServer failed to listen";
-        return false;
-    }
-    mIsIPv6 = true;
-    mFdHandle = event::Loop::loop()->addFd(mFd, event::Loop::FdRead,
-                                           std::bind(&TcpServer::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
-    return true;
+    return listen(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), true);
 }
 
 void TcpServer::close()
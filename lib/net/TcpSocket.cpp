@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <openssl/err.h>
 #include <mutex>
+#include <utility>
 
 using namespace reckoning;
 using namespace reckoning::net;
@@ -15,8 +16,14 @@ std::string TcpSocket::sCAPath;
 
 static std::once_flag initTLSFlag;
 
+#if defined(HAVE_IO_URING)
+// the most pending writes that go out in a single send
+enum { SendBatch = 64 };
+#endif
+
 TcpSocket::TcpSocket()
-    : mMode(Plain), mFd4(-1), mFd6(-1), mWriteOffset(0), mState(Idle)
+    : mMode(Plain), mFd4(-1), mFd6(-1), mWriteOffset(0),
+      mReadBudgetBytes(DefaultReadBudgetBytes), mReadBudgetReads(DefaultReadBudgetReads), mState(Idle)
 {
 }
 
@@ -102,6 +109,12 @@ void TcpSocket::socketCallback(int fd, uint8_t flags)
 {
     assert(fd != -1);
 
+#if defined(HAVE_IO_URING)
+    // readiness from before the ring took over the reads
+    if (mRingRecv)
+        flags &= ~event::Loop::FdRead;
+#endif
+
     auto processPlain = [&](int& fd, event::Loop::FD& handle, int& otherfd, event::Loop::FD& otherHandle) {
         int e;
         if (flags & event::Loop::FdError) {
@@ -111,14 +124,7 @@ void TcpSocket::socketCallback(int fd, uint8_t flags)
             return;
         }
         if (flags & event::Loop::FdRead) {
-            for (;;) {
-                auto buf = read();
-                if (buf) {
-                    mData.emit(std::move(buf));
-                } else {
-                    break;
-                }
-            }
+            processRead(fd);
         }
         if (flags & event::Loop::FdWrite) {
             // remove select for write
@@ -146,6 +152,10 @@ void TcpSocket::socketCallback(int fd, uint8_t flags)
                         otherfd = -1;
                     }
                     mState = Connected;
+#if defined(HAVE_IO_URING)
+                    // before anyone hears about it, so that their first writes go through the ring
+                    startRing(fd);
+#endif
                     mStateChanged.emit(Connected);
                 }
             }
@@ -176,7 +186,7 @@ void TcpSocket::socketCallback(int fd, uint8_t flags)
             case Connected:
                 if (mSsl.readWaitState == SSLReadWaitingForRead) {
                     // retry read
-                    auto buf = read();
+                    auto buf = readData();
                     if (buf) {
                         mData.emit(std::move(buf));
                     }
@@ -185,14 +195,9 @@ void TcpSocket::socketCallback(int fd, uint8_t flags)
                     // retry write
                     processWrite(fd);
                 }
-                while (mSsl.readWaitState == SSLNotWaiting) {
+                if (mSsl.readWaitState == SSLNotWaiting) {
                     // do the reads
-                    auto buf = read();
-                    if (buf) {
-                        mData.emit(std::move(buf));
-                    } else {
-                        break;
-                    }
+                    processRead(fd);
                 }
                 break;
             default:
@@ -247,7 +252,7 @@ void TcpSocket::socketCallback(int fd, uint8_t flags)
             case Connected:
                 if (mSsl.readWaitState == SSLReadWaitingForWrite) {
                     // retry read
-                    auto buf = read();
+                    auto buf = readData();
                     if (buf) {
                         mData.emit(std::move(buf));
                     }
@@ -316,6 +321,9 @@ void TcpSocket::internalConnect(int e, int& fd, event::Loop::FD& handle, int& ot
         // we're connected
         if (mMode == Plain) {
             mState = Connected;
+#if defined(HAVE_IO_URING)
+            startRing(fd);
+#endif
             mStateChanged.emit(Connected);
             processWrite(fd);
         } else {
@@ -370,7 +378,7 @@ void TcpSocket::connect(const IPv4& ip, uint16_t port, Mode mode)
 #ifdef HAVE_NONBLOCK
     util::socket::setFlag(mFd4, O_NONBLOCK);
 #endif
-    mFd4Handle = event::Loop::loop()->addFd(mFd4, event::Loop::FdRead, std::bind(&TcpSocket::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
+    mFd4Handle = event::Loop::loop()->addFd(mFd4, event::Loop::FdRead | event::Loop::FdEdgeWrite, std::bind(&TcpSocket::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
@@ -398,7 +406,7 @@ void TcpSocket::connect(const IPv6& ip, uint16_t port, Mode mode)
 #ifdef HAVE_NONBLOCK
     util::socket::setFlag(mFd6, O_NONBLOCK);
 #endif
-    mFd6Handle = event::Loop::loop()->addFd(mFd6, event::Loop::FdRead, std::bind(&TcpSocket::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
+    mFd6Handle = event::Loop::loop()->addFd(mFd6, event::Loop::FdRead | event::Loop::FdEdgeWrite, std::bind(&TcpSocket::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
     struct sockaddr_in6 addr;
     memset(&addr, 0, sizeof(sockaddr_in6));
     addr.sin6_family = AF_INET6;
@@ -422,7 +430,10 @@ void TcpSocket::setSocket(int fd, bool ipv6)
     auto& handle = (ipv6 ? mFd6Handle : mFd4Handle);
     fdes = fd;
     mState = Connected;
-    handle = event::Loop::loop()->addFd(fdes, event::Loop::FdRead, std::bind(&TcpSocket::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
+    handle = event::Loop::loop()->addFd(fdes, event::Loop::FdRead | event::Loop::FdEdgeWrite, std::bind(&TcpSocket::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
+#if defined(HAVE_IO_URING)
+    startRing(fdes);
+#endif
 }
 
 void TcpSocket::close()
@@ -444,10 +455,252 @@ void TcpSocket::close()
         mFd6Handle.remove();
         mFd6 = -1;
     }
+#if defined(HAVE_IO_URING)
+    // the ring holds on to what it was sending until the kernel is done with it
+    mRingRecv = mRingSend = mReceiving = false;
+    mSending.reset();
+#endif
+    if (mReader) {
+        mReader->done = true;
+        wakeReader();
+    }
+}
+
+TcpSocket::ReadAwaiter TcpSocket::read()
+{
+    if (!mReader) {
+        mReader = std::make_unique<Reader>();
+        mReader->done = mState == Closed || mState == Error;
+        mData.connect([this](std::shared_ptr<buffer::Buffer>&& buf) {
+            mReader->queue.push_back(std::move(buf));
+            wakeReader();
+        });
+        mStateChanged.connect([this](State state) {
+            if (state == Closed || state == Error) {
+                mReader->done = true;
+                wakeReader();
+            }
+        });
+    }
+    return ReadAwaiter(shared_from_this());
+}
+
+void TcpSocket::wakeReader()
+{
+    // resume from the loop rather than from inside whatever socket code got us
+    // here, the coroutine might let go of the last reference to us
+    if (!mReader->waiting || mReader->waking)
+        return;
+    auto loop = event::Loop::loop();
+    if (!loop)
+        return;
+    mReader->waking = true;
+    loop->post([weak = weak_from_this()]() {
+        auto socket = weak.lock();
+        if (!socket)
+            return;
+        Reader& reader = *socket->mReader;
+        reader.waking = false;
+        // whoever we were posted for might be gone by now, and whoever is waiting
+        // instead might be waiting for data that hasn't come in yet
+        if (!reader.waiting || (reader.queue.empty() && !reader.done))
+            return;
+        std::exchange(reader.waiting, nullptr).resume();
+    });
+}
+
+void TcpSocket::resumeReading()
+{
+    mReader->paused = false;
+    // the backends are edge triggered, whatever piled up in the meantime won't be
+    // reported again by itself
+    const int fd = mFd4 != -1 ? mFd4 : mFd6;
+    if (fd == -1)
+        return;
+#if defined(HAVE_IO_URING)
+    if (mRingRecv) {
+        // if the stopped recv hasn't come back yet recvCompleted() takes it up again
+        if (!mReceiving)
+            startRecv(fd);
+        return;
+    }
+#endif
+    if (auto loop = event::Loop::loop())
+        loop->retryFd(fd, event::Loop::FdRead);
+}
+
+#if defined(HAVE_IO_URING)
+void TcpSocket::startRing(int fd)
+{
+    if (fd == -1 || mMode != Plain)
+        return;
+    auto loop = event::Loop::loop();
+    if (!loop)
+        return;
+    mRingRecv = mRingSend = true;
+    startRecv(fd);
+    if (!mRingRecv) {
+        // no ring after all
+        mRingSend = false;
+        return;
+    }
+    // the ring does the reads and writes, nothing to poll for anymore
+    loop->updateFd(fd, 0);
+}
+
+void TcpSocket::startRecv(int fd)
+{
+    auto loop = event::Loop::loop();
+    mReceiving = loop && loop->recvMultishot(fd, [this](int result, const uint8_t* data) {
+        recvCompleted(result, data);
+    });
+    if (!mReceiving)
+        mRingRecv = false;
+}
+
+void TcpSocket::recvCompleted(int result, const uint8_t* data)
+{
+    if (result > 0) {
+        std::shared_ptr<buffer::Buffer> buf = buffer::Pool<20, BufferSize>::pool().get();
+        buf->assign(data, result);
+        mData.emit(std::move(buf));
+        if (mReader && !mReader->paused && mReader->queue.size() >= ReadQueueBuffers) {
+            // read() isn't keeping up, leave the rest with the kernel until it does
+            mReader->paused = true;
+            const int fd = mFd4 != -1 ? mFd4 : mFd6;
+            if (fd != -1)
+                event::Loop::loop()->stopRecv(fd);
+        }
+        return;
+    }
+
+    mReceiving = false;
+    const int fd = mFd4 != -1 ? mFd4 : mFd6;
+    if (result == -ECANCELED) {
+        // stopped for read(), unless it's caught up again in the meantime
+        if (fd != -1 && (!mReader || !mReader->paused))
+            startRecv(fd);
+        return;
+    }
+    if ((result == -EINVAL || result == -ENOBUFS) && fd != -1) {
+        // no multishot recv in this kernel or no buffers to recv into, back to readiness
+        // for the reads
+        mRingRecv = false;
+        auto loop = event::Loop::loop();
+        loop->updateFd(fd, event::Loop::FdRead);
+        loop->retryFd(fd, event::Loop::FdRead);
+        return;
+    }
+
+    close();
+    if (!result) {
+        mState = Closed;
+        mStateChanged.emit(Closed);
+        return;
+    }
+    mState = Error;
+    mStateChanged.emit(Error);
+
+    Log(Log::Error) << "failed to read" << -result;
+}
+
+void TcpSocket::sendPending(int fd)
+{
+    if (mSending || mPendingWrites.empty())
+        return;
+    // whatever's queued up goes out as one send, the ring keeps the buffers until the
+    // kernel is done with them
+    const size_t count = std::min<size_t>(mPendingWrites.size(), SendBatch);
+    mSending = std::make_shared<std::vector<std::shared_ptr<buffer::Buffer> > >(
+        std::make_move_iterator(mPendingWrites.begin()), std::make_move_iterator(mPendingWrites.begin() + count));
+    mPendingWrites.erase(mPendingWrites.begin(), mPendingWrites.begin() + count);
+
+    iovec iov[SendBatch];
+    for (size_t i = 0; i < count; ++i) {
+        const auto& buffer = (*mSending)[i];
+        const size_t offset = i ? 0 : mWriteOffset;
+        iov[i].iov_base = buffer->data() + offset;
+        iov[i].iov_len = buffer->size() - offset;
+    }
+    if (!event::Loop::loop()->sendv(fd, iov, count, mSending, [this](int result) { sendCompleted(result); })) {
+        Log(Log::Error) << "failed to send on fd" << fd;
+
+        close();
+
+        mState = Error;
+        mStateChanged.emit(Error);
+    }
+}
+
+void TcpSocket::sendCompleted(int result)
+{
+    auto sent = std::move(mSending);
+    if (result < 0) {
+        Log(Log::Error) << "failed to write to fd" << (mFd4 != -1 ? mFd4 : mFd6) << -result;
+
+        close();
+
+        mState = Error;
+        mStateChanged.emit(Error);
+        return;
+    }
+    // short sends are rare with MSG_WAITALL, what didn't make it goes back to the front
+    size_t left = result;
+    auto it = sent->begin();
+    while (it != sent->end()) {
+        const size_t size = (*it)->size() - mWriteOffset;
+        if (left < size) {
+            mWriteOffset += left;
+            break;
+        }
+        left -= size;
+        mWriteOffset = 0;
+        ++it;
+    }
+    mPendingWrites.insert(mPendingWrites.begin(), std::make_move_iterator(it), std::make_move_iterator(sent->end()));
+
+    const int fd = mFd4 != -1 ? mFd4 : mFd6;
+    if (fd != -1)
+        sendPending(fd);
+}
+#endif
+
+void TcpSocket::processRead(int fd)
+{
+    size_t bytes = 0, reads = 0;
+    for (;;) {
+        if (mReader && mReader->queue.size() >= ReadQueueBuffers) {
+            // read() isn't keeping up, leave the rest with the kernel until it does
+            mReader->paused = true;
+            return;
+        }
+        if (bytes >= mReadBudgetBytes || reads >= mReadBudgetReads) {
+            // there might be more, come back once everyone else had a go
+            if (fd == mFd4 || fd == mFd6) {
+                if (auto loop = event::Loop::loop())
+                    loop->retryFd(fd, event::Loop::FdRead);
+            }
+            return;
+        }
+        auto buf = readData();
+        if (!buf)
+            return;
+        bytes += buf->size();
+        ++reads;
+        mData.emit(std::move(buf));
+        if (mMode == TLS && mSsl.readWaitState != SSLNotWaiting)
+            return;
+    }
 }
 
 void TcpSocket::processWrite(int fd)
 {
+#if defined(HAVE_IO_URING)
+    if (mRingSend) {
+        sendPending(fd);
+        return;
+    }
+#endif
     auto writePlain = [&](const std::shared_ptr<buffer::Buffer>& buffer) {
         int e;
         eintrwrap(e, ::write(fd, buffer->data() + mWriteOffset, buffer->size() - mWriteOffset));
@@ -515,7 +768,7 @@ void TcpSocket::processWrite(int fd)
     mPendingWrites.erase(mPendingWrites.begin(), it);
 }
 
-std::shared_ptr<buffer::Buffer> TcpSocket::read(size_t bytes)
+std::shared_ptr<buffer::Buffer> TcpSocket::readData(size_t bytes)
 {
     if (mFd4 == -1 && mFd6 == -1) {
         // sorry, we're closed
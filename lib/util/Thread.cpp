@@ -0,0 +1,100 @@
+#include <util/Thread.h>
+#include "config.h"
+#include <cerrno>
+#include <pthread.h>
+#ifdef HAVE_PTHREAD_AFFINITY
+#include <sched.h>
+#endif
+#ifdef HAVE_SET_MEMPOLICY
+#include <climits>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+#endif
+
+using namespace reckoning;
+
+bool util::thread::setName(const std::string& name)
+{
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+    // anything longer and it fails with ERANGE
+    const int e = pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    if (e != 0)
+        errno = e;
+    return e == 0;
+#elif defined(__APPLE__)
+    return pthread_setname_np(name.c_str()) == 0;
+#else
+    (void)name;
+    return false;
+#endif
+}
+
+bool util::thread::setAffinity(const std::vector<unsigned int>& cpus)
+{
+#ifdef HAVE_PTHREAD_AFFINITY
+    if (cpus.empty())
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned int cpu : cpus) {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    const int e = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (e != 0)
+        errno = e;
+    return e == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+std::vector<unsigned int> util::thread::affinity()
+{
+    std::vector<unsigned int> cpus;
+#ifdef HAVE_PTHREAD_AFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    const int e = pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+    if (e != 0) {
+        errno = e;
+        return cpus;
+    }
+    for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set))
+            cpus.push_back(cpu);
+    }
+#endif
+    return cpus;
+}
+
+int util::thread::numaNode()
+{
+#ifdef HAVE_SET_MEMPOLICY
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+        return static_cast<int>(node);
+#endif
+    return -1;
+}
+
+bool util::thread::setMemoryNode(int node)
+{
+#ifdef HAVE_SET_MEMPOLICY
+    if (node < 0) {
+        errno = EINVAL;
+        return false;
+    }
+    // no libnuma needed for this one. the kernel reads one bit less than maxnode says
+    constexpr size_t bits = sizeof(unsigned long) * CHAR_BIT;
+    std::vector<unsigned long> mask(node / bits + 1);
+    mask[node / bits] |= 1UL << (node % bits);
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+}
@@ -1 +1 @@
-set(UTIL_SOURCES Random.cpp)
+set(UTIL_SOURCES Random.cpp Thread.cpp)